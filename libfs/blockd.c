@@ -0,0 +1,223 @@
+/*
+ * blockd - Block server
+ *
+ * Serve a virtual disk file to libfs clients over a Unix domain socket, see
+ * blockd.h for the protocol. Clients open the disk as "unix:<socket path>".
+ *
+ * Usage: blockd <diskname> <socket path>
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "blockd.h"
+#include "disk.h"
+
+#define blockd_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Served disk image */
+static int disk_fd;
+static size_t disk_bcount;
+
+/* Transfer buffer, large enough for the biggest request */
+static char xfer_buf[BLOCKD_MAX_BLOCKS * BLOCK_SIZE];
+
+/* Send or receive exactly @len bytes, returns 1 on a clean hang up */
+static int client_io(int fd, int out, void *buf, size_t len)
+{
+	while (len) {
+		ssize_t ret = out ? send(fd, buf, len, MSG_NOSIGNAL)
+				  : recv(fd, buf, len, 0);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			perror(out ? "send" : "recv");
+			return -1;
+		}
+		if (ret == 0)
+			return 1;
+		buf = (char *)buf + ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* Read or write @len bytes of the disk image at @off */
+static int disk_io(int write_op, size_t off, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t ret = write_op ?
+			pwrite(disk_fd, xfer_buf + done, len - done, off + done) :
+			pread(disk_fd, xfer_buf + done, len - done, off + done);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			perror(write_op ? "pwrite" : "pread");
+			return -1;
+		}
+		done += ret;
+	}
+
+	return 0;
+}
+
+/* Serve requests of one client until it hangs up */
+static void serve(int fd)
+{
+	struct blockd_req req;
+	struct blockd_resp resp;
+	int ret;
+
+	while (!(ret = client_io(fd, 0, &req, sizeof(req)))) {
+		size_t off = (size_t)req.block * BLOCK_SIZE;
+		size_t len = (size_t)req.count * BLOCK_SIZE;
+
+		if (req.magic != BLOCKD_MAGIC) {
+			blockd_error("invalid request");
+			return;
+		}
+
+		resp.magic = BLOCKD_MAGIC;
+		resp.tag = req.tag;
+		resp.status = 0;
+		resp.count = 0;
+
+		/* Only INFO and SYNC requests don't address blocks */
+		if (req.op != BLOCKD_OP_INFO && req.op != BLOCKD_OP_SYNC &&
+		    (req.block >= disk_bcount || req.count > disk_bcount - req.block)) {
+			blockd_error("block range out of bounds (%u+%u/%zu)",
+				     req.block, req.count, disk_bcount);
+			resp.status = -1;
+		}
+
+		/* Data transfers are bounded by the transfer buffer */
+		if ((req.op == BLOCKD_OP_READ || req.op == BLOCKD_OP_WRITE) &&
+		    req.count > BLOCKD_MAX_BLOCKS) {
+			blockd_error("request too large (%u blocks)", req.count);
+			return;
+		}
+
+		switch (req.op) {
+		case BLOCKD_OP_INFO:
+			resp.count = disk_bcount;
+			break;
+		case BLOCKD_OP_READ:
+			if (!resp.status && disk_io(0, off, len))
+				resp.status = -1;
+			if (!resp.status)
+				resp.count = req.count;
+			break;
+		case BLOCKD_OP_WRITE:
+			/* The payload always follows, even for a bad range */
+			if (client_io(fd, 0, xfer_buf, len))
+				return;
+			if (!resp.status && disk_io(1, off, len))
+				resp.status = -1;
+			break;
+		case BLOCKD_OP_DISCARD:
+			if (!resp.status &&
+			    fallocate(disk_fd,
+				      FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				      off, len) < 0)
+				resp.status = -1;
+			break;
+		case BLOCKD_OP_SYNC:
+			if (fdatasync(disk_fd) < 0) {
+				perror("fdatasync");
+				resp.status = -1;
+			}
+			break;
+		default:
+			blockd_error("unknown request %u", req.op);
+			resp.status = -1;
+		}
+
+		if (client_io(fd, 1, &resp, sizeof(resp)))
+			return;
+		if (resp.count && req.op == BLOCKD_OP_READ &&
+		    client_io(fd, 1, xfer_buf, len))
+			return;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct stat st;
+	int sock;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s <diskname> <socket path>\n", argv[0]);
+		exit(1);
+	}
+
+	if ((disk_fd = open(argv[1], O_RDWR)) < 0) {
+		perror("open");
+		exit(1);
+	}
+
+	if (fstat(disk_fd, &st)) {
+		perror("fstat");
+		exit(1);
+	}
+
+	if (st.st_size % BLOCK_SIZE != 0) {
+		blockd_error("size '%zu' is not multiple of '%d'",
+			     st.st_size, BLOCK_SIZE);
+		exit(1);
+	}
+	disk_bcount = st.st_size / BLOCK_SIZE;
+
+	if (strlen(argv[2]) >= sizeof(addr.sun_path)) {
+		blockd_error("socket path too long '%s'", argv[2]);
+		exit(1);
+	}
+	strcpy(addr.sun_path, argv[2]);
+
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		exit(1);
+	}
+
+	/* Replace a stale socket left by a previous server */
+	unlink(argv[2]);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(sock, 8) < 0) {
+		perror("bind");
+		exit(1);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	/* One client at a time, a libfs client owns the whole disk */
+	while (1) {
+		int fd = accept(sock, NULL, NULL);
+
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("accept");
+			exit(1);
+		}
+
+		serve(fd);
+		close(fd);
+	}
+
+	return 0;
+}
@@ -0,0 +1,49 @@
+#ifndef _BLOCKD_H
+#define _BLOCKD_H
+
+#include <stdint.h>
+
+/*
+ * Wire protocol between disk.c and the block server (blockd).
+ *
+ * The client sends requests, each made of a header optionally followed by the
+ * blocks to write. The server answers each request with a response header,
+ * followed by the blocks read if the request was a successful read. Requests
+ * are tagged by the client and any number of them can be outstanding, the
+ * server answers them in order.
+ */
+
+/** Prefix of the disk names designating a block server socket */
+#define BLOCKD_PREFIX "unix:"
+
+/** Magic number starting every header */
+#define BLOCKD_MAGIC 0x4b4c4244
+
+/** Maximum number of blocks transferred by a single request */
+#define BLOCKD_MAX_BLOCKS 64
+
+/** Request types */
+enum {
+	BLOCKD_OP_INFO,		/* get the block count of the disk */
+	BLOCKD_OP_READ,		/* read @count blocks from @block */
+	BLOCKD_OP_WRITE,	/* write @count blocks at @block */
+	BLOCKD_OP_DISCARD,	/* discard @count blocks from @block */
+	BLOCKD_OP_SYNC,		/* flush written blocks to stable storage */
+};
+
+struct blockd_req {
+	uint32_t magic;
+	uint32_t tag;
+	uint32_t op;
+	uint32_t block;
+	uint32_t count;
+};
+
+struct blockd_resp {
+	uint32_t magic;
+	uint32_t tag;
+	int32_t status;		/* 0 on success, -1 otherwise */
+	uint32_t count;		/* blocks that follow, or disk size for INFO */
+};
+
+#endif /* _BLOCKD_H */
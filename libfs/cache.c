@@ -0,0 +1,116 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "disk.h"
+
+struct cache_entry {
+	int index;					/* FAT index of the cached block, -1 if unused */
+	unsigned long last_use;				/* LRU stamp */
+	uint8_t data[BLOCK_SIZE];
+};
+
+static struct cache_entry* entries;
+
+/* FAT index -> slot in entries, -1 if not cached */
+static int16_t* slot_of;
+static size_t num_index;
+
+static unsigned long clock_tick;
+
+int cache_init(size_t nblocks)
+{
+	entries = malloc(sizeof(struct cache_entry) * CACHE_BLOCK_COUNT);
+	slot_of = malloc(sizeof(int16_t) * nblocks);
+
+	if(entries == NULL || slot_of == NULL) {
+		free(entries);
+		free(slot_of);
+		return -1;
+	}
+
+	for(int i = 0; i < CACHE_BLOCK_COUNT; i++) {
+		entries[i].index = -1;
+		entries[i].last_use = 0;
+	}
+	memset(slot_of, -1, sizeof(int16_t) * nblocks);
+
+	num_index = nblocks;
+	clock_tick = 0;
+
+	return 0;
+}
+
+void cache_destroy(void)
+{
+	free(entries);
+	free(slot_of);
+	entries = NULL;
+	slot_of = NULL;
+	num_index = 0;
+}
+
+int cache_read(size_t index, void *buf)
+{
+	if(index >= num_index || slot_of[index] < 0)
+		return -1;
+
+	struct cache_entry* entry = &entries[slot_of[index]];
+
+	entry->last_use = ++clock_tick;
+	memcpy(buf, entry->data, BLOCK_SIZE);
+
+	return 0;
+}
+
+void cache_update(size_t index, const void *buf)
+{
+	int slot;
+
+	if(index >= num_index)
+		return;
+
+	slot = slot_of[index];
+
+	/* not cached yet: take a free slot, or evict the least recently used one */
+	if(slot < 0) {
+		slot = 0;
+		for(int i = 0; i < CACHE_BLOCK_COUNT; i++) {
+			if(entries[i].index == -1) {
+				slot = i;
+				break;
+			}
+			if(entries[i].last_use < entries[slot].last_use)
+				slot = i;
+		}
+
+		if(entries[slot].index != -1)
+			slot_of[entries[slot].index] = -1;
+
+		entries[slot].index = index;
+		slot_of[index] = slot;
+	}
+
+	entries[slot].last_use = ++clock_tick;
+	memcpy(entries[slot].data, buf, BLOCK_SIZE);
+}
+
+void cache_demote(size_t index)
+{
+	if(index >= num_index || slot_of[index] < 0)
+		return;
+
+	/* free slots are taken before it, then it goes before any used block */
+	entries[slot_of[index]].last_use = 0;
+}
+
+void cache_invalidate(size_t index)
+{
+	if(index >= num_index || slot_of[index] < 0)
+		return;
+
+	entries[slot_of[index]].index = -1;
+	entries[slot_of[index]].last_use = 0;
+	slot_of[index] = -1;
+}
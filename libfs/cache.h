@@ -0,0 +1,59 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stddef.h> /* for size_t definition */
+
+/*
+ * Write-through cache of data block contents, indexed by FAT entry. Cached
+ * blocks hold the data as seen by files, i.e. after decompression.
+ */
+
+/** Number of blocks held in the cache */
+#define CACHE_BLOCK_COUNT 64
+
+/**
+ * cache_init - Set up an empty cache
+ * @nblocks: Number of data blocks that can be cached
+ *
+ * Return: -1 in case of memory allocation failure. 0 otherwise.
+ */
+int cache_init(size_t nblocks);
+
+/**
+ * cache_destroy - Drop all cached blocks and release the cache
+ */
+void cache_destroy(void);
+
+/**
+ * cache_read - Look up a block in the cache
+ * @index: FAT index of the data block
+ * @buf: Data buffer to be filled with the content of the block
+ *
+ * Return: -1 if block @index is not cached. 0 otherwise.
+ */
+int cache_read(size_t index, void *buf);
+
+/**
+ * cache_update - Insert or refresh a block in the cache
+ * @index: FAT index of the data block
+ * @buf: Current content of the block
+ *
+ * The least recently used block is evicted if the cache is full.
+ */
+void cache_update(size_t index, const void *buf);
+
+/**
+ * cache_demote - Make a block the next one to be evicted
+ * @index: FAT index of the data block
+ *
+ * The block stays cached until a block that is not cached yet needs its slot.
+ */
+void cache_demote(size_t index);
+
+/**
+ * cache_invalidate - Remove a block from the cache
+ * @index: FAT index of the data block
+ */
+void cache_invalidate(size_t index);
+
+#endif /* _CACHE_H */
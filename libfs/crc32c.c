@@ -0,0 +1,96 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+/* reflected Castagnoli polynomial */
+#define CRC32C_POLY 0x82F63B78
+
+/* slice-by-8 tables, built on first use */
+static uint32_t crc_table[8][256];
+static int table_ready;
+
+/* selected implementation */
+static uint32_t (*crc_impl)(uint32_t crc, const uint8_t* p, size_t len);
+
+static void build_table(void) {
+	for(int i = 0; i < 256; i++) {
+		uint32_t crc = i;
+
+		for(int bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+
+		crc_table[0][i] = crc;
+	}
+
+	for(int i = 0; i < 256; i++) {
+		for(int slice = 1; slice < 8; slice++)
+			crc_table[slice][i] = (crc_table[slice - 1][i] >> 8) ^ crc_table[0][crc_table[slice - 1][i] & 0xFF];
+	}
+
+	table_ready = 1;
+}
+
+static uint32_t crc_sw(uint32_t crc, const uint8_t* p, size_t len) {
+	if(!table_ready)
+		build_table();
+
+	/* eight bytes per step */
+	while(len >= 8) {
+		uint32_t lo, hi;
+
+		memcpy(&lo, p, 4);
+		memcpy(&hi, p + 4, 4);
+		lo ^= crc;
+
+		crc = crc_table[7][lo & 0xFF] ^ crc_table[6][(lo >> 8) & 0xFF] ^
+		      crc_table[5][(lo >> 16) & 0xFF] ^ crc_table[4][lo >> 24] ^
+		      crc_table[3][hi & 0xFF] ^ crc_table[2][(hi >> 8) & 0xFF] ^
+		      crc_table[1][(hi >> 16) & 0xFF] ^ crc_table[0][hi >> 24];
+
+		p += 8;
+		len -= 8;
+	}
+
+	while(len--)
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xFF];
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw(uint32_t crc, const uint8_t* p, size_t len) {
+	uint64_t crc64 = crc;
+
+	while(len >= 8) {
+		uint64_t v;
+
+		memcpy(&v, p, 8);
+		crc64 = _mm_crc32_u64(crc64, v);
+		p += 8;
+		len -= 8;
+	}
+
+	crc = crc64;
+	while(len--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	if(crc_impl == NULL) {
+		crc_impl = crc_sw;
+#if defined(__x86_64__)
+		if(__builtin_cpu_supports("sse4.2"))
+			crc_impl = crc_hw;
+#endif
+	}
+
+	return ~crc_impl(~crc, buf, len);
+}
@@ -0,0 +1,20 @@
+#ifndef _CRC32C_H
+#define _CRC32C_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+/**
+ * crc32c - Compute a CRC32C (Castagnoli) checksum
+ * @crc: Checksum of the preceding data, 0 to start a new checksum
+ * @buf: Data to checksum
+ * @len: Size of @buf in bytes
+ *
+ * Uses the SSE4.2 crc32 instruction when the CPU has it, and a table-driven
+ * implementation otherwise.
+ *
+ * Return: Checksum of the data so far.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif /* _CRC32C_H */
@@ -0,0 +1,83 @@
+/*
+ * defrag - Defragment a file system
+ *
+ * Move the data blocks of the files of a virtual disk until every file that
+ * can be is made of a single run of consecutive blocks. The work is done in
+ * steps of a few blocks, the same way a long-running program would call
+ * fs_defrag() in the background. On a log-structured file system, the
+ * sparse segments are then compacted with fs_clean(). The fragmentation of
+ * the named files is reported before and after.
+ *
+ * Usage: defrag <diskname> [filename...]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fs.h"
+
+/* Blocks moved per step */
+#define DEFRAG_STEP 64
+
+static void print_extents(int count, char **names)
+{
+	for (int i = 0; i < count; i++) {
+		int fd = fs_open(names[i]);
+
+		if (fd < 0) {
+			fprintf(stderr, "defrag: cannot open %s\n", names[i]);
+			continue;
+		}
+
+		printf("%s: %d extent(s)\n", names[i], fs_extents(fd));
+		fs_close(fd);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct fs_statfs stat;
+	int moved = 0, steps = 0, ret;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <diskname> [filename...]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (fs_mount(argv[1])) {
+		fprintf(stderr, "defrag: cannot mount %s\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	print_extents(argc - 2, argv + 2);
+
+	while ((ret = fs_defrag(DEFRAG_STEP)) > 0) {
+		moved += ret;
+		steps++;
+	}
+
+	if (ret < 0)
+		fprintf(stderr, "defrag: failed after moving %d block(s)\n", moved);
+	else
+		printf("moved %d block(s) in %d step(s)\n", moved, steps);
+
+	if (ret >= 0 && !fs_statfs(&stat) && (stat.features & FS_FEAT_LOG)) {
+		moved = 0;
+		while ((ret = fs_clean(DEFRAG_STEP)) > 0)
+			moved += ret;
+
+		if (ret < 0)
+			fprintf(stderr, "defrag: cleaning failed after moving %d block(s)\n",
+				moved);
+		else
+			printf("cleaned %d block(s)\n", moved);
+	}
+
+	print_extents(argc - 2, argv + 2);
+
+	if (fs_umount()) {
+		fprintf(stderr, "defrag: cannot unmount %s\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
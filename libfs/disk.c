@@ -1,10 +1,19 @@
+#define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#include "blockd.h"
 #include "disk.h"
 
 #define block_error(fmt, ...) \
@@ -13,17 +22,389 @@
 /* Invalid file descriptor */
 #define INVALID_FD -1
 
+/* Maximum number of requests outstanding at the block server */
+#define REMOTE_MAX_INFLIGHT 32
+
 /* Disk instance description */
 struct disk {
 	/* File descriptor */
 	int fd;
 	/* Block count */
 	size_t bcount;
+	/* Bitmap of blocks known to be holes in the image (read as zeros) */
+	uint8_t *holes;
+	/* Served by a block server, @fd is then the server socket */
+	int remote;
 };
 
 /* Currently open virtual disk (invalid by default) */
 static struct disk disk = { .fd = INVALID_FD };
 
+/* Requests served since the counters were last reset */
+static struct block_stats stats;
+
+static int hole_test(size_t block)
+{
+	if (!disk.holes)
+		return 0;
+
+	return disk.holes[block / 8] & (1 << (block % 8));
+}
+
+static void hole_set(size_t block, int hole)
+{
+	if (!disk.holes)
+		return;
+
+	if (hole)
+		disk.holes[block / 8] |= 1 << (block % 8);
+	else
+		disk.holes[block / 8] &= ~(1 << (block % 8));
+}
+
+/*
+ * Build the hole bitmap of the disk image. Only blocks entirely covered by a
+ * hole are marked, anything the filesystem can't describe is treated as data.
+ */
+static void hole_scan(void)
+{
+	off_t data, hole = 0;
+	off_t end = disk.bcount * BLOCK_SIZE;
+
+	while (hole < end) {
+		data = lseek(disk.fd, hole, SEEK_DATA);
+		if (data < 0)
+			data = (errno == ENXIO) ? end : hole;
+		for (size_t b = (hole + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		     b < (size_t)(data / BLOCK_SIZE); b++)
+			hole_set(b, 1);
+		if (data >= end)
+			break;
+		hole = lseek(disk.fd, data, SEEK_HOLE);
+		if (hole < 0)
+			break;
+	}
+}
+
+/* Send or receive exactly @len bytes on the block server socket */
+static int remote_io(int out, void *buf, size_t len)
+{
+	while (len) {
+		ssize_t ret = out ? send(disk.fd, buf, len, MSG_NOSIGNAL)
+				  : recv(disk.fd, buf, len, 0);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			if (ret < 0)
+				perror(out ? "send" : "recv");
+			else
+				block_error("block server hung up");
+			return -1;
+		}
+		buf = (char *)buf + ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int remote_open(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct blockd_req req = { .magic = BLOCKD_MAGIC, .op = BLOCKD_OP_INFO };
+	struct blockd_resp resp;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		block_error("socket path too long '%s'", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	if ((disk.fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	if (connect(disk.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("connect");
+		goto fail;
+	}
+
+	/* Ask the server for the size of its disk */
+	if (remote_io(1, &req, sizeof(req)) || remote_io(0, &resp, sizeof(resp)))
+		goto fail;
+
+	if (resp.magic != BLOCKD_MAGIC || resp.status) {
+		block_error("invalid answer from block server");
+		goto fail;
+	}
+
+	disk.bcount = resp.count;
+	disk.remote = 1;
+
+	return 0;
+
+fail:
+	close(disk.fd);
+	disk.fd = INVALID_FD;
+	return -1;
+}
+
+/*
+ * Run a batch of requests on the block server. Request i transfers its blocks
+ * from/to @buf at block offset @first[i]. Requests are pipelined: up to
+ * REMOTE_MAX_INFLIGHT of them are sent before waiting for answers, and sending
+ * and receiving are interleaved so neither side stalls on a full socket.
+ */
+static int remote_run(struct blockd_req *reqs, size_t *first, size_t nreq,
+		      void *buf)
+{
+	size_t sent = 0, done = 0, send_off = 0, recv_off = 0;
+	struct blockd_resp resp;
+	int ret = 0;
+
+	for (size_t i = 0; i < nreq; i++) {
+		reqs[i].magic = BLOCKD_MAGIC;
+		reqs[i].tag = i;
+	}
+
+	while (done < nreq) {
+		struct pollfd pfd = { .fd = disk.fd, .events = POLLIN };
+
+		if (sent < nreq && sent - done < REMOTE_MAX_INFLIGHT)
+			pfd.events |= POLLOUT;
+
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			return -1;
+		}
+
+		if (pfd.revents & POLLOUT) {
+			/* Header first, then the blocks to write if any */
+			struct blockd_req *req = &reqs[sent];
+			size_t payload = req->op == BLOCKD_OP_WRITE ?
+					 req->count * BLOCK_SIZE : 0;
+			char *ptr;
+			size_t len;
+			ssize_t n;
+
+			if (send_off < sizeof(*req)) {
+				ptr = (char *)req + send_off;
+				len = sizeof(*req) - send_off;
+			} else {
+				ptr = (char *)buf + first[sent] * BLOCK_SIZE +
+				      send_off - sizeof(*req);
+				len = sizeof(*req) + payload - send_off;
+			}
+
+			n = send(disk.fd, ptr, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (n < 0 && errno != EAGAIN && errno != EINTR) {
+				perror("send");
+				return -1;
+			}
+			if (n > 0)
+				send_off += n;
+			if (send_off == sizeof(*req) + payload) {
+				sent++;
+				send_off = 0;
+			}
+		}
+
+		if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+			/* Response header first, then the blocks read if any */
+			size_t payload = 0;
+			char *ptr;
+			size_t len;
+			ssize_t n;
+
+			if (recv_off >= sizeof(resp) && !resp.status &&
+			    reqs[resp.tag].op == BLOCKD_OP_READ)
+				payload = resp.count * BLOCK_SIZE;
+
+			if (recv_off < sizeof(resp)) {
+				ptr = (char *)&resp + recv_off;
+				len = sizeof(resp) - recv_off;
+			} else {
+				ptr = (char *)buf + first[resp.tag] * BLOCK_SIZE +
+				      recv_off - sizeof(resp);
+				len = sizeof(resp) + payload - recv_off;
+			}
+
+			n = recv(disk.fd, ptr, len, MSG_DONTWAIT);
+			if (n == 0) {
+				block_error("block server hung up");
+				return -1;
+			}
+			if (n < 0 && errno != EAGAIN && errno != EINTR) {
+				perror("recv");
+				return -1;
+			}
+			if (n > 0)
+				recv_off += n;
+
+			if (recv_off == sizeof(resp)) {
+				/* Match the answer with its request */
+				if (resp.magic != BLOCKD_MAGIC || resp.tag >= sent ||
+				    (!resp.status &&
+				     reqs[resp.tag].op == BLOCKD_OP_READ &&
+				     resp.count != reqs[resp.tag].count)) {
+					block_error("invalid answer from block server");
+					return -1;
+				}
+				if (resp.status)
+					ret = -1;
+				if (!resp.status &&
+				    reqs[resp.tag].op == BLOCKD_OP_READ)
+					payload = resp.count * BLOCK_SIZE;
+			}
+
+			if (recv_off >= sizeof(resp) &&
+			    recv_off == sizeof(resp) + payload) {
+				done++;
+				recv_off = 0;
+			}
+		}
+	}
+
+	if (ret)
+		block_error("block server failed a request");
+
+	return ret;
+}
+
+/* Split a list of blocks into runs of consecutive blocks and transfer them */
+static int remote_transfer(uint32_t op, const size_t *blocks, size_t count,
+			   void *buf)
+{
+	struct blockd_req *reqs = malloc(sizeof(*reqs) * count);
+	size_t *first = malloc(sizeof(*first) * count);
+	size_t nreq = 0;
+	int ret = -1;
+
+	if (!reqs || !first) {
+		perror("malloc");
+		goto out;
+	}
+
+	for (size_t i = 0; i < count; nreq++) {
+		size_t j = i + 1;
+
+		while (j < count && j - i < BLOCKD_MAX_BLOCKS &&
+		       blocks[j] == blocks[j - 1] + 1)
+			j++;
+
+		reqs[nreq].op = op;
+		reqs[nreq].block = blocks[i];
+		reqs[nreq].count = j - i;
+		first[nreq] = i;
+		i = j;
+	}
+
+	ret = remote_run(reqs, first, nreq, buf);
+
+out:
+	free(reqs);
+	free(first);
+	return ret;
+}
+
+/* Transfer a list of blocks from/to the image file, one syscall per run */
+static int file_transfer(int write_op, const size_t *blocks, size_t count,
+			 void *buf)
+{
+	for (size_t i = 0; i < count;) {
+		size_t j = i + 1;
+		size_t len, done = 0;
+		char *ptr = (char *)buf + i * BLOCK_SIZE;
+
+		/* Holes are all zeros, no need to ask the host filesystem */
+		if (!write_op && hole_test(blocks[i])) {
+			memset(ptr, 0, BLOCK_SIZE);
+			i++;
+			continue;
+		}
+
+		while (j < count && blocks[j] == blocks[j - 1] + 1 &&
+		       (write_op || !hole_test(blocks[j])))
+			j++;
+
+		len = (j - i) * BLOCK_SIZE;
+		while (done < len) {
+			ssize_t ret;
+			off_t off = blocks[i] * BLOCK_SIZE + done;
+
+			if (write_op)
+				ret = pwrite(disk.fd, ptr + done, len - done, off);
+			else
+				ret = pread(disk.fd, ptr + done, len - done, off);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0) {
+				perror(write_op ? "pwrite" : "pread");
+				return -1;
+			}
+			done += ret;
+		}
+
+		if (write_op) {
+			for (size_t b = i; b < j; b++)
+				hole_set(blocks[b], 0);
+		}
+
+		i = j;
+	}
+
+	return 0;
+}
+
+/* Validate a list of blocks */
+static int check_blocks(const size_t *blocks, size_t count)
+{
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		if (blocks[i] >= disk.bcount) {
+			block_error("block index out of bounds (%zu/%zu)",
+				    blocks[i], disk.bcount);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int block_disk_create(const char *diskname, size_t count)
+{
+	int fd;
+
+	if (!diskname || !strncmp(diskname, BLOCKD_PREFIX, strlen(BLOCKD_PREFIX))) {
+		block_error("invalid file diskname");
+		return -1;
+	}
+
+	if ((fd = open(diskname, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("open");
+		return -1;
+	}
+
+	/* Sparse image: no block is allocated until it is written */
+	if (ftruncate(fd, count * BLOCK_SIZE)) {
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+
+	return 0;
+}
+
 int block_disk_open(const char *diskname)
 {
 	int fd;
@@ -39,6 +420,10 @@ int block_disk_open(const char *diskname)
 		return -1;
 	}
 
+	/* Disk served by a block server */
+	if (!strncmp(diskname, BLOCKD_PREFIX, strlen(BLOCKD_PREFIX)))
+		return remote_open(diskname + strlen(BLOCKD_PREFIX));
+
 	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
 		perror("open");
 		return -1;
@@ -59,6 +444,15 @@ int block_disk_open(const char *diskname)
 	disk.fd = fd;
 	disk.bcount = st.st_size / BLOCK_SIZE;
 
+	disk.holes = calloc((disk.bcount + 7) / 8, 1);
+	if (!disk.holes) {
+		perror("calloc");
+		close(fd);
+		disk.fd = INVALID_FD;
+		return -1;
+	}
+	hole_scan();
+
 	return 0;
 }
 
@@ -70,8 +464,11 @@ int block_disk_close(void)
 	}
 
 	close(disk.fd);
+	free(disk.holes);
 
 	disk.fd = INVALID_FD;
+	disk.holes = NULL;
+	disk.remote = 0;
 
 	return 0;
 }
@@ -88,57 +485,164 @@ int block_disk_count(void)
 
 int block_write(size_t block, const void *buf)
 {
-	if (disk.fd == INVALID_FD) {
-		block_error("no disk currently open");
+	return block_write_many(&block, 1, buf);
+}
+
+int block_read(size_t block, void *buf)
+{
+	return block_read_many(&block, 1, buf);
+}
+
+int block_write_many(const size_t *blocks, size_t count, const void *buf)
+{
+	if (check_blocks(blocks, count))
+		return -1;
+
+	stats.write_reqs++;
+	stats.write_blocks += count;
+
+	if (disk.remote)
+		return remote_transfer(BLOCKD_OP_WRITE, blocks, count,
+				       (void *)buf);
+
+	return file_transfer(1, blocks, count, (void *)buf);
+}
+
+int block_read_many(const size_t *blocks, size_t count, void *buf)
+{
+	if (check_blocks(blocks, count))
 		return -1;
+
+	stats.read_reqs++;
+	stats.read_blocks += count;
+
+	if (disk.remote)
+		return remote_transfer(BLOCKD_OP_READ, blocks, count, buf);
+
+	return file_transfer(0, blocks, count, buf);
+}
+
+void *block_map(const size_t *blocks, size_t count)
+{
+	char *addr;
+
+	if (check_blocks(blocks, count) || !count)
+		return NULL;
+
+	/* Only image files can be mapped, and only if blocks are whole pages */
+	if (disk.remote || BLOCK_SIZE % sysconf(_SC_PAGESIZE)) {
+		block_error("disk cannot be mapped");
+		return NULL;
+	}
+
+	/* Reserve the whole range, then map each run of blocks over it */
+	addr = mmap(NULL, count * BLOCK_SIZE, PROT_NONE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	for (size_t i = 0; i < count;) {
+		size_t j = i + 1;
+
+		while (j < count && blocks[j] == blocks[j - 1] + 1)
+			j++;
+
+		if (mmap(addr + i * BLOCK_SIZE, (j - i) * BLOCK_SIZE, PROT_READ,
+			 MAP_SHARED | MAP_FIXED, disk.fd,
+			 blocks[i] * BLOCK_SIZE) == MAP_FAILED) {
+			perror("mmap");
+			munmap(addr, count * BLOCK_SIZE);
+			return NULL;
+		}
+
+		i = j;
+	}
+
+	return addr;
+}
+
+int block_unmap(void *addr, size_t count)
+{
+	if (munmap(addr, count * BLOCK_SIZE) < 0) {
+		perror("munmap");
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	return 0;
+}
+
+int block_sync(void)
+{
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	stats.syncs++;
+
+	if (disk.remote) {
+		struct blockd_req req = { .op = BLOCKD_OP_SYNC };
+		size_t first = 0;
+
+		return remote_run(&req, &first, 1, NULL);
+	}
+
+	if (fdatasync(disk.fd) < 0) {
+		perror("fdatasync");
 		return -1;
 	}
 
 	return 0;
 }
 
-int block_read(size_t block, void *buf)
+int block_discard(size_t block, size_t count)
 {
 	if (disk.fd == INVALID_FD) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	if (block >= disk.bcount || count > disk.bcount - block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, count, disk.bcount);
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
-		return -1;
+	stats.discard_reqs++;
+	stats.discard_blocks += count;
+
+	if (disk.remote) {
+		struct blockd_req req = {
+			.op = BLOCKD_OP_DISCARD, .block = block, .count = count
+		};
+		size_t first = 0;
+
+		return remote_run(&req, &first, 1, NULL);
 	}
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	/* Deallocate the range in the host image, the file size is unchanged */
+	if (fallocate(disk.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      block * BLOCK_SIZE, count * BLOCK_SIZE) < 0) {
+		/* Not every host filesystem can punch holes, that's fine */
+		if (errno != EOPNOTSUPP)
+			perror("fallocate");
 		return -1;
 	}
 
+	for (size_t b = block; b < block + count; b++)
+		hole_set(b, 1);
+
 	return 0;
 }
 
+void block_get_stats(struct block_stats *out)
+{
+	*out = stats;
+}
+
+void block_reset_stats(void)
+{
+	memset(&stats, 0, sizeof(stats));
+}
@@ -6,6 +6,17 @@
 /** Size of a disk block in bytes */
 #define BLOCK_SIZE 4096
 
+/** Counters of the requests made to the virtual disk */
+struct block_stats {
+	size_t read_reqs;	/* block_read() and block_read_many() calls */
+	size_t read_blocks;	/* Blocks read */
+	size_t write_reqs;	/* block_write() and block_write_many() calls */
+	size_t write_blocks;	/* Blocks written */
+	size_t syncs;		/* block_sync() calls */
+	size_t discard_reqs;	/* block_discard() calls */
+	size_t discard_blocks;	/* Blocks discarded */
+};
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
@@ -14,11 +25,27 @@
  * blocks can be read from it with block_read() or written to it with
  * block_write().
  *
+ * If @diskname is of the form "unix:<path>", the disk is instead served by the
+ * block server (blockd) listening on the Unix domain socket <path>.
+ *
  * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
  * or is already open. 0 otherwise.
  */
 int block_disk_open(const char *diskname);
 
+/**
+ * block_disk_create - Create virtual disk file
+ * @diskname: Name of the virtual disk file
+ * @count: Number of blocks of the disk
+ *
+ * Create virtual disk file @diskname, or truncate it if it exists, as a sparse
+ * file of @count zeroed blocks. The disk is not opened.
+ *
+ * Return: -1 if @diskname is invalid or is a block server, or if the virtual
+ * disk file cannot be created. 0 otherwise.
+ */
+int block_disk_create(const char *diskname, size_t count);
+
 /**
  * block_disk_close - Close virtual disk file
  *
@@ -60,5 +87,100 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_write_many - Write several blocks to disk
+ * @blocks: Indexes of the blocks to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer holding the @count blocks, one after the other
+ *
+ * Write the content of buffer @buf (@count times %BLOCK_SIZE bytes) in the
+ * virtual disk's blocks @blocks. Runs of consecutive blocks are written with a
+ * single request, and requests to a block server are pipelined.
+ *
+ * Return: -1 if a block is out of bounds or inaccessible or if a writing
+ * operation fails. 0 otherwise.
+ */
+int block_write_many(const size_t *blocks, size_t count, const void *buf);
+
+/**
+ * block_read_many - Read several blocks from disk
+ * @blocks: Indexes of the blocks to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with the @count blocks, one after the other
+ *
+ * Read the content of virtual disk's blocks @blocks (@count times %BLOCK_SIZE
+ * bytes) into buffer @buf. Runs of consecutive blocks are read with a single
+ * request, and requests to a block server are pipelined.
+ *
+ * Return: -1 if a block is out of bounds or inaccessible, or if a reading
+ * operation fails. 0 otherwise.
+ */
+int block_read_many(const size_t *blocks, size_t count, void *buf);
+
+/**
+ * block_map - Map blocks in memory
+ * @blocks: Indexes of the blocks to map
+ * @count: Number of blocks to map
+ *
+ * Map the virtual disk's blocks @blocks, read-only, in a single contiguous
+ * range of memory where they appear one after the other. Runs of consecutive
+ * blocks share a single mapping. The mapping reflects later writes to the
+ * blocks. Only virtual disk files can be mapped.
+ *
+ * Return: NULL if a block is out of bounds, if @count is 0, or if the disk
+ * cannot be mapped. Otherwise return the address of the first block.
+ */
+void *block_map(const size_t *blocks, size_t count);
+
+/**
+ * block_unmap - Unmap blocks
+ * @addr: Address returned by block_map()
+ * @count: Number of blocks that were mapped
+ *
+ * Return: -1 if the blocks cannot be unmapped. 0 otherwise.
+ */
+int block_unmap(void *addr, size_t count);
+
+/**
+ * block_sync - Flush written blocks to stable storage
+ *
+ * Make sure that all the blocks written so far would survive a crash.
+ *
+ * Return: -1 if there was no virtual disk file opened or if the flush fails. 0
+ * otherwise.
+ */
+int block_sync(void);
+
+/**
+ * block_discard - Discard a range of blocks
+ * @block: Index of the first block to discard
+ * @count: Number of blocks to discard
+ *
+ * Tell the virtual disk that the content of the @count blocks starting at
+ * @block is no longer needed. The corresponding storage is released from the
+ * virtual disk file (which keeps its size) and the blocks read back as zeros
+ * until they are written again.
+ *
+ * Return: -1 if the range is out of bounds or if the virtual disk file cannot
+ * release storage. 0 otherwise.
+ */
+int block_discard(size_t block, size_t count);
+
+/**
+ * block_get_stats - Get the request counters
+ * @stats: Counters to fill
+ *
+ * Give the number of requests made to virtual disks, and of blocks they
+ * involved, since the program started or since the last call to
+ * block_reset_stats(). Failed requests are counted as well, except those with
+ * blocks out of bounds.
+ */
+void block_get_stats(struct block_stats *stats);
+
+/**
+ * block_reset_stats - Reset the request counters
+ */
+void block_reset_stats(void);
+
 #endif /* _DISK_H */
 
@@ -0,0 +1,202 @@
+#include <stdint.h>
+
+#include "fat_scan.h"
+
+/* one implementation of the scans */
+struct fat_scan_impl {
+	size_t (*count_free)(const uint16_t* fat, size_t count);
+	size_t (*find)(const uint16_t* fat, size_t start, size_t count, int free);
+	size_t (*find_invalid)(const uint16_t* fat, size_t count, uint16_t limit, uint16_t marker);
+};
+
+/* selected implementation */
+static const struct fat_scan_impl* scan_impl;
+
+/* an entry is out of range if it falls in [limit, marker) */
+static int entry_invalid(uint16_t entry, uint16_t limit, uint16_t marker) {
+	return entry >= limit && entry < marker;
+}
+
+static size_t count_free_sw(const uint16_t* fat, size_t count) {
+	size_t result = 0;
+
+	for(size_t i = 0; i < count; i++)
+		result += fat[i] == 0;
+
+	return result;
+}
+
+static size_t find_sw(const uint16_t* fat, size_t start, size_t count, int free) {
+	for(size_t i = start; i < count; i++) {
+		if((fat[i] == 0) == free)
+			return i;
+	}
+
+	return count;
+}
+
+static size_t find_invalid_sw(const uint16_t* fat, size_t count, uint16_t limit, uint16_t marker) {
+	for(size_t i = 0; i < count; i++) {
+		if(entry_invalid(fat[i], limit, marker))
+			return i;
+	}
+
+	return count;
+}
+
+static const struct fat_scan_impl scan_sw = { count_free_sw, find_sw, find_invalid_sw };
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+/*
+ * the compare masks have two bits per 16-bit lane: lane i matches if bit 2 * i
+ * is set. unsigned range checks shift the entries by @limit and flip the sign
+ * bit, so that a signed comparison tells if they are below @marker - @limit.
+ */
+
+static size_t count_free_sse2(const uint16_t* fat, size_t count) {
+	__m128i zero = _mm_setzero_si128();
+	size_t result = 0;
+	size_t i = 0;
+
+	for(; i + 8 <= count; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(fat + i));
+
+		result += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi16(v, zero))) / 2;
+	}
+
+	return result + count_free_sw(fat + i, count - i);
+}
+
+static size_t find_sse2(const uint16_t* fat, size_t start, size_t count, int free) {
+	__m128i zero = _mm_setzero_si128();
+	unsigned int flip = free ? 0 : 0xFFFF;
+	size_t i = start;
+
+	for(; i + 8 <= count; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(fat + i));
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(v, zero)) ^ flip;
+
+		if(mask != 0)
+			return i + __builtin_ctz(mask) / 2;
+	}
+
+	return find_sw(fat, i, count, free);
+}
+
+static size_t find_invalid_sse2(const uint16_t* fat, size_t count, uint16_t limit, uint16_t marker) {
+	__m128i shift = _mm_set1_epi16(limit);
+	__m128i sign = _mm_set1_epi16((short)0x8000);
+	__m128i bound = _mm_set1_epi16((short)((uint16_t)(marker - limit) ^ 0x8000));
+	size_t i = 0;
+
+	for(; i + 8 <= count; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(fat + i));
+		__m128i rel = _mm_xor_si128(_mm_sub_epi16(v, shift), sign);
+		unsigned int mask = _mm_movemask_epi8(_mm_cmplt_epi16(rel, bound));
+
+		if(mask != 0)
+			return i + __builtin_ctz(mask) / 2;
+	}
+
+	for(; i < count; i++) {
+		if(entry_invalid(fat[i], limit, marker))
+			return i;
+	}
+
+	return count;
+}
+
+static const struct fat_scan_impl scan_sse2 = { count_free_sse2, find_sse2, find_invalid_sse2 };
+
+__attribute__((target("avx2")))
+static size_t count_free_avx2(const uint16_t* fat, size_t count) {
+	__m256i zero = _mm256_setzero_si256();
+	size_t result = 0;
+	size_t i = 0;
+
+	for(; i + 16 <= count; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(fat + i));
+
+		result += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi16(v, zero))) / 2;
+	}
+
+	return result + count_free_sse2(fat + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static size_t find_avx2(const uint16_t* fat, size_t start, size_t count, int free) {
+	__m256i zero = _mm256_setzero_si256();
+	unsigned int flip = free ? 0 : 0xFFFFFFFF;
+	size_t i = start;
+
+	for(; i + 16 <= count; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(fat + i));
+		unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi16(v, zero)) ^ flip;
+
+		if(mask != 0)
+			return i + __builtin_ctz(mask) / 2;
+	}
+
+	return find_sse2(fat, i, count, free);
+}
+
+__attribute__((target("avx2")))
+static size_t find_invalid_avx2(const uint16_t* fat, size_t count, uint16_t limit, uint16_t marker) {
+	__m256i shift = _mm256_set1_epi16(limit);
+	__m256i sign = _mm256_set1_epi16((short)0x8000);
+	__m256i bound = _mm256_set1_epi16((short)((uint16_t)(marker - limit) ^ 0x8000));
+	size_t i = 0;
+
+	for(; i + 16 <= count; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(fat + i));
+		__m256i rel = _mm256_xor_si256(_mm256_sub_epi16(v, shift), sign);
+		unsigned int mask = _mm256_movemask_epi8(_mm256_cmpgt_epi16(bound, rel));
+
+		if(mask != 0)
+			return i + __builtin_ctz(mask) / 2;
+	}
+
+	return i + find_invalid_sse2(fat + i, count - i, limit, marker);
+}
+
+static const struct fat_scan_impl scan_avx2 = { count_free_avx2, find_avx2, find_invalid_avx2 };
+#endif
+
+static const struct fat_scan_impl* get_impl(void) {
+	if(scan_impl == NULL) {
+		scan_impl = &scan_sw;
+#if defined(__x86_64__)
+		/* SSE2 is part of x86-64 */
+		scan_impl = &scan_sse2;
+		if(__builtin_cpu_supports("avx2"))
+			scan_impl = &scan_avx2;
+#endif
+	}
+
+	return scan_impl;
+}
+
+size_t fat_count_free(const uint16_t *fat, size_t count)
+{
+	return get_impl()->count_free(fat, count);
+}
+
+size_t fat_find_free(const uint16_t *fat, size_t start, size_t count)
+{
+	return get_impl()->find(fat, start, count, 1);
+}
+
+size_t fat_find_used(const uint16_t *fat, size_t start, size_t count)
+{
+	return get_impl()->find(fat, start, count, 0);
+}
+
+size_t fat_find_invalid(const uint16_t *fat, size_t count, uint16_t limit, uint16_t marker)
+{
+	if(marker <= limit)
+		return count;
+
+	return get_impl()->find_invalid(fat, count, limit, marker);
+}
@@ -0,0 +1,56 @@
+#ifndef _FAT_SCAN_H
+#define _FAT_SCAN_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+/*
+ * Scans of FAT entries, several entries at a time with AVX2 or SSE2 when the
+ * CPU has them, one at a time otherwise
+ */
+
+/**
+ * fat_count_free - Count free FAT entries
+ * @fat: FAT entries
+ * @count: Number of entries
+ *
+ * Return: Number of entries of @fat that are 0.
+ */
+size_t fat_count_free(const uint16_t *fat, size_t count);
+
+/**
+ * fat_find_free - Find the next free FAT entry
+ * @fat: FAT entries
+ * @start: Index of the first entry to look at
+ * @count: Number of entries
+ *
+ * Return: Index of the first entry of @fat from @start on that is 0, @count if
+ * there is none.
+ */
+size_t fat_find_free(const uint16_t *fat, size_t start, size_t count);
+
+/**
+ * fat_find_used - Find the next used FAT entry
+ * @fat: FAT entries
+ * @start: Index of the first entry to look at
+ * @count: Number of entries
+ *
+ * Return: Index of the first entry of @fat from @start on that is not 0,
+ * @count if there is none.
+ */
+size_t fat_find_used(const uint16_t *fat, size_t start, size_t count);
+
+/**
+ * fat_find_invalid - Find a FAT entry out of range
+ * @fat: FAT entries
+ * @count: Number of entries
+ * @limit: Entries below @limit are valid
+ * @marker: Entries from @marker on are valid (special values)
+ *
+ * Return: Index of the first entry of @fat that is at least @limit but below
+ * @marker, @count if there is none.
+ */
+size_t fat_find_invalid(const uint16_t *fat, size_t count, uint16_t limit,
+			uint16_t marker);
+
+#endif /* _FAT_SCAN_H */
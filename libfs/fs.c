@@ -4,93 +4,175 @@
 #include <stdint.h>
 #include <string.h>
 
+#include "cache.h"
+#include "crc32c.h"
 #include "disk.h"
+#include "fat_scan.h"
 #include "fs.h"
+#include "fs_layout.h"
+#include "hash64.h"
+#include "lz.h"
 
-#define FAT_EOC 0xFFFF
+/* number of freed data blocks a journal commit accumulates before discarding them */
+#define DISCARD_BATCH 256
 
-/* 
-*	structure of the file system:
-* 	super_block | FAT | root_directory | DATA ...
-*/
+/* metadata operations batched in one journal group commit */
+#define JOURNAL_GROUP_OPS 32
+
+/* log-structured mode: data blocks per segment, and most blocks in use for a segment to be cleaned */
+#define LOG_SEG_BLK 64
+#define LOG_CLEAN_MAX_USED (LOG_SEG_BLK * 3 / 4)
+
+/* slots of the hash tables looking up root_dir entries by name */
+#define DIR_INDEX_SIZE (2 * FS_FILE_MAX_COUNT)
 
-struct super_block {
-	/* super block occupy [1] block */
-	uint8_t signature[8];				/* [8 bytes] Signature (must be equal to "ECS150FS") */
-	uint16_t total_virtual_blk;			/* [2 bytes] Total amount of blocks of virtual disk */
-	uint16_t root_dir_index;			/* [2 bytes] Root directory block index */
-	uint16_t data_index;				/* [2 bytes] Data block start index */
-	uint16_t total_data_blk;			/* [2 bytes] Amount of data blocks */
-	uint8_t total_FAT_blk;				/* [1 byte] Number of blocks for FAT */
-	uint8_t padding[4079];				/* [4079 bytes] Unused/Padding */
-}__attribute__((packed));
-
-struct root_directory {
-	/* root_directory occupy [1] block with 128 entries*/
-	uint8_t file_name[FS_FILENAME_LEN];		/* [16 bytes] Filename (including NULL character) */
-	uint32_t file_size;				/* [4 bytes] Size of the file (in bytes) */
-	uint16_t ini_data_index;			/* [2 bytes] Index of the first data block */
-	uint8_t padding[10];				/* [10 bytes] Unused/Padding */
-}__attribute__((packed));
+/* largest amount of written data a buffered descriptor holds before flushing */
+#define DELALLOC_MAX_SIZE (256 * BLOCK_SIZE)
 
+/* readahead window bounds in blocks, the largest leaves half of the cache to the rest */
+#define READAHEAD_MIN_BLK 4
+#define READAHEAD_MAX_BLK (CACHE_BLOCK_COUNT / 2)
+
+/* in-memory structures used on every call are aligned on cache lines */
+#define CACHE_LINE_SIZE 64
+
+/* one cache line per open file, the fields used by every read and write first */
 struct file_descriptor {
 	/* one entry of the file_descriptor holds the file's directory */
 	struct root_directory* file_dir_entry;
 	int offset;
-}__attribute__((packed));
+	/* access hint (FS_ADV_*), readahead window and blocks read ahead up to ra_end */
+	int advice;
+	int ra_next;
+	int ra_window;
+	int ra_end;
+	/* buffered writes: bytes [dirty_start, dirty_start + dirty_len) not written yet */
+	int buffered;
+	int dirty_start;
+	int dirty_len;
+	int dirty_cap;
+	uint8_t* dirty_buf;
+}__attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* allocator state, kept up to date instead of scanning the metadata */
+struct alloc_state {
+	int fat_free;					/* free FAT entries */
+	int data_free;					/* data blocks used by no file */
+	int rdir_free;					/* free root directory entries */
+	int open;					/* open files */
+	int ref_hint;					/* where to look for the next free data block */
+}__attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* fingerprint of the content of a data block */
+struct dedup_entry {
+	uint64_t hash;
+	uint16_t next;					/* next data block of the same bucket, 0 if last */
+	uint8_t indexed;				/* the block is in the index */
+};
+
+/* super block, FAT and root directory as laid out on disk, loaded and written back in one piece */
+static uint8_t* meta_area;
 
 /* FAT occupy [total_data_blk * 2 / BLOCK_SIZE] blocks*/
 static uint16_t* file_alloc_table;			/* [2 bytes per entry] FAT */
 
-/* pointers to both the super block and root directory */
+/* pointers to both the super block and root directory, within meta_area */
 static struct super_block* super_blk;
 static struct root_directory* root_dir;
 
-/* pointer to the fd list */
-static struct file_descriptor* fd_table;
+/* root_dir slots of the files by name hash, -1 for empty buckets */
+static int16_t dir_index[DIR_INDEX_SIZE];
+
+/* the fd list */
+static struct file_descriptor fd_table[FS_OPEN_MAX_COUNT];
 
 /* flag to see if a disk is mounted */
 static int mount_flag = 0;
 
+static struct alloc_state alloc;
+
+/* bitmap of freed data blocks waiting to be discarded, and how many */
+static uint8_t* discard_map;
+static int discard_count;
+
+/* compression map: blocks used by the compressed unit starting at each FAT index (0 if raw) */
+static uint8_t* comp_map;
+
+/* CRC32C of each data block as last written, 0 if unknown */
+static uint32_t* crc_table;
+
+/* remap table: data block holding the content of each FAT index (0 if its own) */
+static uint16_t* remap_table;
+
+/* number of FAT entries using each data block, rebuilt at mount */
+static uint16_t* ref_count;
+
+/* fingerprint index of the data blocks whose content is known, chained by bucket */
+static struct dedup_entry* dedup_index;
+static uint16_t* dedup_bucket;
+static int dedup_mask;
+
+/* log-structured mode: FAT entries given a block at the log head and not written yet */
+static uint8_t* log_fresh;
+
+/*
+ * log-structured mode: data blocks moved away from whose move is not durable yet,
+ * the metadata on disk may still point to them so they can't be reused
+ */
+static uint8_t* log_pinned;
+static int log_pinned_count;
+
+/* next root directory slot to look at for defragmentation */
+static int defrag_slot;
+
+/* journal: blocks and directory slots changed since the last group commit */
+static uint8_t* jdirty_blk;
+static uint8_t jdirty_dir[FS_FILE_MAX_COUNT / 8];
+static int journal_head;				/* next journal block to write */
+static uint32_t journal_next_seq;			/* sequence number of the next group */
+static int journal_ops;					/* operations in the current group */
+
+/* scratch buffers for compressed units */
+static uint8_t unit_buf[COMP_UNIT_BLK * BLOCK_SIZE];
+static uint8_t inflate_buf[COMP_UNIT_BLK * BLOCK_SIZE];
+static uint8_t comp_buf[COMP_UNIT_BLK * BLOCK_SIZE];
+
 /* 
 *	helpers
 */
 /* get the number of free fat entries */
 int get_fat_free(void) {
-	int result = 0;
-
-	for(int i = 0; i < super_blk->total_data_blk; i++) {
-		if(file_alloc_table[i] == 0)
-			result++;
-	}
-
-	return result;
+	return alloc.fat_free;
 }
 
 /* get the free root_dir entries */
 int get_root_dir_free(void) {
-	int result = 0;
-
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if(root_dir[i].file_name[0] == '\0')
-			result++;
-	}
-
-	return result;
+	return alloc.rdir_free;
 }
 
 /* get the number of free fd_table */
 int get_free_fd(void) {
-	int result = 0;
+	return FS_OPEN_MAX_COUNT - alloc.open;
+}
 
-	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-		if(fd_table[i].file_dir_entry == NULL)
-			result++;
+/* count the free FAT entries, data blocks and root_dir entries from scratch */
+void count_free(void) {
+	alloc.fat_free = fat_count_free(file_alloc_table, super_blk->total_data_blk);
+
+	alloc.data_free = 0;
+	for(int i = 1; ref_count != NULL && i < super_blk->total_data_blk; i++) {
+		if(ref_count[i] == 0)
+			alloc.data_free++;
 	}
 
-	return result;
+	alloc.rdir_free = 0;
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if(root_dir[i].file_name[0] == '\0')
+			alloc.rdir_free++;
+	}
 }
 
+
 /* get the number of block for holding the file */
 int get_num_file_blk(int fd) {
 	int result = 0;
@@ -115,560 +197,3217 @@ int get_count_to_blk(size_t count) {
 	}
 }
 
-/* get the list of free fat indexes */
-int* get_free_fat_indexes(int num_blk) {
-	int count = 0;
-	int* free_indexes = malloc(sizeof(int) * num_blk);
+/* the journal must record the state of this data block in the next group */
+void mark_blk_dirty(int fat_index) {
+	if(jdirty_blk != NULL)
+		jdirty_blk[fat_index / 8] |= 1 << (fat_index % 8);
+}
 
-	for(int i = 0; i < super_blk->total_data_blk && count < num_blk; i++) {
-		if(file_alloc_table[i] == 0) {
-			free_indexes[count] = i;
-			count++;
-		}
-	}
+/* the journal must record this root directory slot in the next group */
+void mark_dir_dirty(struct root_directory* entry) {
+	int slot = entry - root_dir;
 
-	return free_indexes;
+	if(jdirty_blk != NULL)
+		jdirty_dir[slot / 8] |= 1 << (slot % 8);
 }
 
-/* get the file's all indexes */
-int* get_file_fat_indexes(int fd) {
-	int file_require_blk = get_num_file_blk(fd);
-	int current_index;
-	int* file_fat_indexes = malloc(sizeof(int) * file_require_blk);
+/* hash of a file name */
+uint32_t name_hash(const char* name) {
+	uint32_t hash = 2166136261u;
 
-	file_fat_indexes[0] = fd_table[fd].file_dir_entry->ini_data_index;
-	current_index = file_fat_indexes[0];
-	for(int i = 1; i < file_require_blk; i++) {
-		file_fat_indexes[i] = file_alloc_table[current_index];
-		current_index = file_alloc_table[current_index];
-	}
+	for(int i = 0; i < FS_FILENAME_LEN && name[i] != '\0'; i++)
+		hash = (hash ^ (uint8_t)name[i]) * 16777619u;
 
-	return file_fat_indexes;
+	return hash;
 }
 
-/* earse all allocated data structures */
-void clean_FS(void) {
-	free(super_blk);
-	free(root_dir);
-	free(file_alloc_table);
-}
+/* add root_dir entry @slot to the directory index */
+void dir_index_add(int slot) {
+	int i = name_hash((char*)root_dir[slot].file_name) % DIR_INDEX_SIZE;
 
-/* set all the FD's root_dir pointer to NULL */
-void init_fd_table(void) {
-	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-		fd_table[i].file_dir_entry = NULL;
-		fd_table[i].offset = 0;
-	}
+	while(dir_index[i] != -1)
+		i = (i + 1) % DIR_INDEX_SIZE;
+
+	dir_index[i] = slot;
 }
 
-/* 
-*	library functions
-*/
-int fs_mount(const char *diskname)
-{
-	/* a temporary pointer to the signiture */
-	uint8_t* sig_tmp;
+/* remove root_dir entry @slot from the directory index, while it still has its name */
+void dir_index_remove(int slot) {
+	int i = name_hash((char*)root_dir[slot].file_name) % DIR_INDEX_SIZE;
+	int j;
 
-	/* initialize the FD table */
-	fd_table = malloc(sizeof(struct file_descriptor) * FS_OPEN_MAX_COUNT);
-	init_fd_table();
+	while(dir_index[i] != slot)
+		i = (i + 1) % DIR_INDEX_SIZE;
 
-	/* allocate memory for super block, FAT, and root directory */
-	super_blk = malloc(sizeof(struct super_block));
-	root_dir = malloc(sizeof(struct root_directory) * FS_FILE_MAX_COUNT);
+	/* move back the entries that would not be found past the hole anymore */
+	dir_index[i] = -1;
+	for(j = (i + 1) % DIR_INDEX_SIZE; dir_index[j] != -1; j = (j + 1) % DIR_INDEX_SIZE) {
+		int home = name_hash((char*)root_dir[dir_index[j]].file_name) % DIR_INDEX_SIZE;
 
-	/* open up the virtual disk */
-	/* return -1 if the disk cannot be open */
-	if(block_disk_open(diskname) == -1)
-		return -1;
+		if(i <= j ? (home > i && home <= j) : (home > i || home <= j))
+			continue;
 
-	/* load the super block and root directory with the corresponding block in the virtual disk */
-	/* ERROR CHECKING */
-	if(block_read(0, super_blk) == -1)
-		return -1;
-	
-	if(block_read(super_blk->root_dir_index, root_dir) == -1)
-		return -1;
+		dir_index[i] = dir_index[j];
+		dir_index[j] = -1;
+		i = j;
+	}
+}
 
-	/* initialize the FAT once we have the super block information*/
-	file_alloc_table = malloc(super_blk->total_FAT_blk * BLOCK_SIZE);
+/* index all the files of the root_dir by name, in one pass */
+void dir_index_build(void) {
+	for(int i = 0; i < DIR_INDEX_SIZE; i++)
+		dir_index[i] = -1;
 
-	/* since the FAT spans couple blocks, we need to load each block into the FAT */
-	/* FAT starts at the second block and ends before the root_dir_block */
-	/* since each address increment increment the whole address by 2 bytes, */
-	/* so if to increment by 1 byte, divide BLOCK_SIZE by 2*/
-	for(int i = 1; i <= super_blk->total_FAT_blk; i++){
-		if(block_read(i, file_alloc_table + (BLOCK_SIZE / 2 * (i - 1))) == -1)
-			return -1;
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if(root_dir[i].file_name[0] != '\0')
+			dir_index_add(i);
 	}
+}
 
-	/* ERROR CHECKING */
-	/* 1. check for signiture */
-	sig_tmp = super_blk->signature;
-	if(
-		sig_tmp[0] != 'E' || 
-		sig_tmp[1] != 'C' ||
-		sig_tmp[2] != 'S' ||
-		sig_tmp[3] != '1' ||
-		sig_tmp[4] != '5' ||
-		sig_tmp[5] != '0' ||
-		sig_tmp[6] != 'F' ||
-		sig_tmp[7] != 'S'
-	) return -1;
+/* get the root_dir slot of file @name, -1 if there is none */
+int dir_index_find(const char* name) {
+	for(int i = name_hash(name) % DIR_INDEX_SIZE; dir_index[i] != -1; i = (i + 1) % DIR_INDEX_SIZE) {
+		if(strcmp(name, (char*)root_dir[dir_index[i]].file_name) == 0)
+			return dir_index[i];
+	}
 
-	/* 2. check for block_disk_count */
-	if(super_blk->total_virtual_blk != block_disk_count())
-		return -1;
+	return -1;
+}
 
-	mount_flag = 1;
+/* name a root_dir entry, an empty name frees it */
+void set_file_name(struct root_directory* entry, const char* name) {
+	if(entry->file_name[0] == '\0' && name[0] != '\0')
+		alloc.rdir_free--;
+	else if(entry->file_name[0] != '\0' && name[0] == '\0')
+		alloc.rdir_free++;
 
-	return 0;
+	if(entry->file_name[0] != '\0')
+		dir_index_remove(entry - root_dir);
+
+	memset(entry->file_name, '\0', FS_FILENAME_LEN);
+	strcpy((char*)entry->file_name, name);
+
+	if(name[0] != '\0')
+		dir_index_add(entry - root_dir);
 }
 
-int fs_umount(void)
-{
-	/* if the disk is not mounted */
-	if(!mount_flag)
-		return -1;
+/* turn a free root_dir entry into an empty file */
+void create_entry(struct root_directory* entry, const char* name) {
+	set_file_name(entry, name);
 
-	/* write back super block, FAT, and root directory*/
-	/* ERROR CHECKING */
-	if(block_write(0, super_blk) == -1)
-		return -1;
+	entry->file_size = 0;
 
-	for(int i = 1; i <= super_blk->total_FAT_blk; i++){
-		if(block_write(i, file_alloc_table + (BLOCK_SIZE / 2 * (i - 1))) == -1)
-			return -1;
-	}
+	entry->ini_data_index = FAT_EOC;
+	entry->pack_index = 0;
+	entry->pack_offset = 0;
 
-	if(block_write(super_blk->root_dir_index, root_dir) == -1)
-		return -1;
+	mark_dir_dirty(entry);
+}
 
-	/* deallocate the memeory */
-	clean_FS();
+/* change a FAT entry */
+void fat_set(int fat_index, uint16_t value) {
+	if(file_alloc_table[fat_index] == 0 && value != 0)
+		alloc.fat_free--;
+	else if(file_alloc_table[fat_index] != 0 && value == 0)
+		alloc.fat_free++;
 
-	/* close out the virtual disk */
-	if(block_disk_close() == -1)
-		return -1;
+	file_alloc_table[fat_index] = value;
+	mark_blk_dirty(fat_index);
+}
 
-	mount_flag = 0;
+/* data block holding the content of a FAT entry */
+int get_phys_blk(int fat_index) {
+	if(remap_table != NULL && remap_table[fat_index] != 0)
+		return remap_table[fat_index];
 
-	return 0;
+	return fat_index;
 }
 
-int fs_info(void)
-{
-	if(!mount_flag)
-		return -1;
+/* punch out all the pending data blocks, merging neighbours into ranges */
+void discard_flush(void) {
+	int start = -1;
 
-	fprintf(stdout, "FS Info:\n");
-	fprintf(stdout, "total_blk_count=%d\n", super_blk->total_virtual_blk);
-	fprintf(stdout, "fat_blk_count=%d\n", super_blk->total_FAT_blk);
-	fprintf(stdout, "rdir_blk=%d\n", super_blk->root_dir_index);
-	fprintf(stdout, "data_blk=%d\n", super_blk->data_index);
-	fprintf(stdout, "data_blk_count=%d\n", super_blk->total_data_blk);
-	fprintf(stdout, "fat_free_ratio=%d/%d\n", get_fat_free(), super_blk->total_data_blk);
-	fprintf(stdout, "rdir_free_ratio=%d/%d\n", get_root_dir_free(), FS_FILE_MAX_COUNT);
+	for(int i = 0; i <= super_blk->total_data_blk; i++) {
+		int pending = i < super_blk->total_data_blk && (discard_map[i / 8] & (1 << (i % 8)));
 
-	return 0;
-}
+		if(pending && start == -1) {
+			start = i;
+		} else if(!pending && start != -1) {
+			/* a failed discard only costs space, the blocks are free anyway */
+			block_discard(super_blk->data_index + start, i - start);
+			start = -1;
+		}
+	}
 
-int fs_create(const char *filename)
-{
+	memset(discard_map, 0, (super_blk->total_data_blk + 7) / 8);
+	discard_count = 0;
+}
 
-	/* ERROR CHECKING */
-	/* if a NULL string is passed or the disk is not mounted*/
-	if(filename == NULL || mount_flag == 0)
-		return -1;
+/* queue data block @blk, whose content is not needed anymore, for discarding */
+void discard_phys_blk(int blk) {
+	if(discard_map[blk / 8] & (1 << (blk % 8)))
+		return;
 
-	/* there is no more empty slot for a new file */
-	if(get_root_dir_free() == 0)
-		return -1;
+	discard_map[blk / 8] |= 1 << (blk % 8);
+	discard_count++;
 
-	/* the string cannot exceed 15 characters since last character is NULL */
-	if(strlen(filename) >= FS_FILENAME_LEN)
-		return -1;
+	/*
+	 * the FAT and directory on disk may still point to the block: it is only
+	 * discarded once its release is durable, by a journal commit or by
+	 * fs_sync() and fs_umount() without a journal
+	 */
+}
 
-	/* if the name matches with one of the file: nope! */
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if(strcmp(filename, (char*)root_dir[i].file_name) == 0)
-			return -1;
+/* queue the data block of a FAT entry for discarding */
+void discard_blk(int fat_index) {
+	/* whatever the block holds from now on can't be checked */
+	if(crc_table != NULL) {
+		crc_table[fat_index] = 0;
+		mark_blk_dirty(fat_index);
 	}
 
-	/* SAFE TO PROCEED */
-	/* find empty slot in root_dir and throw all the information into it */
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if(root_dir[i].file_name[0] == '\0') {
-			strcpy((char*)root_dir[i].file_name, filename);
+	discard_phys_blk(get_phys_blk(fat_index));
+}
 
-			root_dir[i].file_size = 0;
+/* a data block is being reused: it must not be discarded anymore */
+void discard_cancel_phys(int blk) {
+	if(discard_map[blk / 8] & (1 << (blk % 8))) {
+		discard_map[blk / 8] &= ~(1 << (blk % 8));
+		discard_count--;
+	}
+}
 
-			root_dir[i].ini_data_index = FAT_EOC;
+/* the data block of a FAT entry is being reused */
+void discard_cancel(int fat_index) {
+	discard_cancel_phys(get_phys_blk(fat_index));
+}
 
-			break;
-		}
+/* a data block moved away from stays taken until the move is durable */
+void log_pin(int blk) {
+	if(log_pinned != NULL && !log_pinned[blk]) {
+		log_pinned[blk] = 1;
+		log_pinned_count++;
+		alloc.data_free--;
 	}
+}
 
-	return 0;
+/* the metadata on disk is up to date: the pinned blocks can be reused */
+void log_unpin_all(void) {
+	if(log_pinned_count == 0)
+		return;
+
+	memset(log_pinned, 0, super_blk->total_data_blk);
+	alloc.data_free += log_pinned_count;
+	log_pinned_count = 0;
 }
 
-int fs_delete(const char *filename)
-{
-	struct root_directory* root_dir_entry = NULL;
+/* a data block no FAT entry uses and no durable metadata may point to */
+int phys_blk_free(int blk) {
+	return ref_count[blk] == 0 && (log_pinned == NULL || !log_pinned[blk]);
+}
 
-	/* ERROR CHECKING */
-	if(filename == NULL || mount_flag == 0)
-		return -1;
+/* find a data block no FAT entry uses */
+int find_free_phys_blk(void) {
+	for(int n = 0; n < super_blk->total_data_blk; n++) {
+		int blk = (alloc.ref_hint + n) % super_blk->total_data_blk;
 
-	/* if the file is not closed */
-	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-		if(fd_table[i].file_dir_entry != NULL) {
-			if(strcmp(filename, (char*)(fd_table[i].file_dir_entry->file_name)) == 0)
-				return -1;
+		if(blk != 0 && phys_blk_free(blk)) {
+			alloc.ref_hint = blk + 1;
+			return blk;
 		}
 	}
 
-	/* find the matching name within the root_dir */
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if(strcmp(filename, (char*)root_dir[i].file_name) == 0) {
-			/* found it !!! */
-			/* assign it to a temp pointer that hold the root_dir entry */
-			root_dir_entry = &(root_dir[i]);
+	return -1;
+}
 
-			break;
+/* point a FAT entry at data block @blk, which gains a user */
+void set_phys_blk(int fat_index, int blk) {
+	remap_table[fat_index] = blk == fat_index ? 0 : blk;
+	if(ref_count[blk]++ == 0)
+		alloc.data_free--;
+	mark_blk_dirty(fat_index);
+}
+
+/* log-structured mode: take the next free data block after the log head, outside segment @avoid_seg */
+int log_alloc(int avoid_seg) {
+	for(int n = 0; n < super_blk->total_data_blk; n++) {
+		int blk = (super_blk->log_head + n) % super_blk->total_data_blk;
+
+		if(blk != 0 && phys_blk_free(blk) && blk / LOG_SEG_BLK != avoid_seg) {
+			super_blk->log_head = blk + 1;
+			return blk;
 		}
 	}
 
-	/* ERROR CHECKING */
-	/* cannot find the file */
-	if(root_dir_entry == NULL)
-		return -1;
+	return -1;
+}
 
-	/* SAFE TO PROCEED */
-	/* start dealing with the FAT deallocation */
-	uint16_t cur_fat_entry = root_dir_entry->ini_data_index;
-	
-	if(cur_fat_entry != FAT_EOC) {
-		/* making sure that the file is not an empty file */
-		while(file_alloc_table[cur_fat_entry] != FAT_EOC) {
-		
-			uint16_t next_fat_entry = file_alloc_table[cur_fat_entry];
+/* defined with the journal below */
+int sync_metadata(void);
 
-			file_alloc_table[cur_fat_entry] = 0;
+/* log-structured mode: every free data block is pinned, make the moves durable to reuse them */
+void log_reclaim(void) {
+	/* without a durable copy to protect, they are free all the same */
+	if(sync_metadata() == -1)
+		log_unpin_all();
+}
 
-			cur_fat_entry = next_fat_entry;
+/* a free FAT entry is being allocated: give it a data block of its own */
+void claim_data_blk(int fat_index) {
+	/* the log head is where it will be written */
+	if(log_fresh != NULL) {
+		int blk = log_alloc(-1);
+
+		if(blk == -1) {
+			log_reclaim();
+			blk = log_alloc(-1);
 		}
 
-		file_alloc_table[cur_fat_entry] = 0;
+		set_phys_blk(fat_index, blk);
+		log_fresh[fat_index] = 1;
+	/* its own block may be in use by a clone */
+	} else if(ref_count != NULL) {
+		set_phys_blk(fat_index, phys_blk_free(fat_index) ? fat_index : find_free_phys_blk());
 	}
 
-	/* deal with the root_dir reset */
-	memset(root_dir_entry->file_name, '\0', FS_FILENAME_LEN);
-	root_dir_entry->file_size = 0;
-	root_dir_entry->ini_data_index = 0;
-
-	return 0;
+	/* the content matters again */
+	discard_cancel(fat_index);
 }
 
-int fs_ls(void)
-{
-	/* ERROR CHECKING */
-	if(mount_flag == 0)
-		return -1;
+/* copy on write: a FAT entry about to be written must not share its data block */
+void unshare_data_blk(int fat_index) {
+	int blk = get_phys_blk(fat_index);
 
-	/* list out all the files in the root directory */
-	fprintf(stdout, "FS Ls:\n");
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if(root_dir[i].file_name[0] != '\0')
-			fprintf(stdout, "file: %s, size: %u, data_blk: %u\n", root_dir[i].file_name, root_dir[i].file_size, root_dir[i].ini_data_index);
-	}
+	if(ref_count == NULL || ref_count[blk] < 2)
+		return;
 
-	return 0;
+	ref_count[blk]--;
+	set_phys_blk(fat_index, phys_blk_free(fat_index) ? fat_index : find_free_phys_blk());
+	discard_cancel(fat_index);
 }
 
-int fs_open(const char *filename)
-{
-	struct root_directory* root_dir_entry = NULL;
-	int free_fd_index = -1;
+/* count the users of every data block */
+void build_ref_count(void) {
+	ref_count = calloc(super_blk->total_data_blk, sizeof(uint16_t));
+	alloc.ref_hint = 1;
 
-	/* ERROR CHECKING */
-	if(get_free_fd() == 0 || filename == NULL || mount_flag == 0)
-		return -1;
+	for(int i = 1; i < super_blk->total_data_blk; i++) {
+		if(file_alloc_table[i] != 0)
+			ref_count[get_phys_blk(i)]++;
+	}
+}
 
-	/* find the matching name within the root_dir */
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if(strcmp(filename, (char*)root_dir[i].file_name) == 0) {
-			/* found it !!! */
-			/* assign it to a temp pointer that hold the root_dir entry */
-			root_dir_entry = &(root_dir[i]);
+/* start with an empty fingerprint index */
+void dedup_init(void) {
+	int num_bucket = 1;
 
-			break;
-		}
-	}
+	while(num_bucket < super_blk->total_data_blk)
+		num_bucket *= 2;
 
-	/* ERROR CHECKING */
-	/* cannot find the file */
-	if(root_dir_entry == NULL)
-		return -1;
+	dedup_index = calloc(super_blk->total_data_blk, sizeof(struct dedup_entry));
+	dedup_bucket = calloc(num_bucket, sizeof(uint16_t));
+	dedup_mask = num_bucket - 1;
+}
 
-	/* SAFE TO PROCEED */
-	/* find the first empty entry of the FD table and throw the root_dir_entry in there */
-	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-		if(fd_table[i].file_dir_entry == NULL) {
-			free_fd_index = i;
+/* the content of data block @blk is about to change or is not needed anymore */
+void dedup_forget(int blk) {
+	uint16_t* link;
 
-			fd_table[i].file_dir_entry = root_dir_entry;
+	if(dedup_index == NULL || !dedup_index[blk].indexed)
+		return;
 
-			break;
-		}
-	}
+	link = &dedup_bucket[dedup_index[blk].hash & dedup_mask];
+	while(*link != blk)
+		link = &dedup_index[*link].next;
 
-	return free_fd_index;
+	*link = dedup_index[blk].next;
+	dedup_index[blk].indexed = 0;
+}
+
+/* data block @blk holds data whose fingerprint is @hash */
+void dedup_insert(int blk, uint64_t hash) {
+	int bucket = hash & dedup_mask;
+
+	dedup_forget(blk);
+
+	dedup_index[blk].hash = hash;
+	dedup_index[blk].next = dedup_bucket[bucket];
+	dedup_index[blk].indexed = 1;
+	dedup_bucket[bucket] = blk;
+}
+
+/* find a data block holding exactly the block of data @buf, -1 if none */
+int dedup_find(const void* buf, uint64_t hash) {
+	uint8_t blk_buf[BLOCK_SIZE];
+
+	for(int blk = dedup_bucket[hash & dedup_mask]; blk != 0; blk = dedup_index[blk].next) {
+		/* equal fingerprints are confirmed byte by byte */
+		if(dedup_index[blk].hash != hash)
+			continue;
+
+		if(block_read(super_blk->data_index + blk, blk_buf) == 0 && memcmp(blk_buf, buf, BLOCK_SIZE) == 0)
+			return blk;
+	}
+
+	return -1;
+}
+
+/* a FAT entry gets its new content by sharing data block @blk, which holds it already */
+void dedup_share(int fat_index, int blk) {
+	int old_blk = get_phys_blk(fat_index);
+
+	if(blk == old_blk)
+		return;
+
+	/* a shared block is never written in place */
+	if(log_fresh != NULL)
+		log_fresh[fat_index] = 0;
+
+	if(--ref_count[old_blk] == 0) {
+		alloc.data_free++;
+		dedup_forget(old_blk);
+		discard_blk(fat_index);
+	}
+
+	set_phys_blk(fat_index, blk);
+}
+
+/* log-structured mode: a FAT entry about to be written moves to a new data block at the log head */
+void log_relocate(int fat_index) {
+	int old_blk = get_phys_blk(fat_index);
+	int blk;
+
+	/* it was given one when allocated, unless it got shared since */
+	if(log_fresh[fat_index]) {
+		log_fresh[fat_index] = 0;
+		if(ref_count[old_blk] == 1)
+			return;
+	}
+
+	/* a full disk is written in place, a shared block still needs one of its own */
+	blk = log_alloc(-1);
+	if(blk == -1 && ref_count[old_blk] > 1) {
+		log_reclaim();
+		blk = log_alloc(-1);
+	}
+
+	if(blk == -1) {
+		unshare_data_blk(fat_index);
+		return;
+	}
+
+	if(--ref_count[old_blk] == 0) {
+		alloc.data_free++;
+		dedup_forget(old_blk);
+		discard_blk(fat_index);
+		log_pin(old_blk);
+	}
+
+	set_phys_blk(fat_index, blk);
+	discard_cancel(fat_index);
+}
+
+/* get the list of free fat indexes */
+int* get_free_fat_indexes(int num_blk) {
+	int count = 0;
+	int* free_indexes = malloc(sizeof(int) * num_blk);
+
+	for(int i = fat_find_free(file_alloc_table, 0, super_blk->total_data_blk); i < super_blk->total_data_blk && count < num_blk; i = fat_find_free(file_alloc_table, i + 1, super_blk->total_data_blk)) {
+		free_indexes[count] = i;
+		claim_data_blk(i);
+		count++;
+	}
+
+	return free_indexes;
+}
+
+/* find @num_blk consecutive free FAT entries, starting the search at @hint */
+int find_free_run(int num_blk, int hint) {
+	if(hint <= 0 || hint >= super_blk->total_data_blk)
+		hint = 1;
+
+	/* two passes: from the hint to the end, then from the start */
+	for(int pass = 0; pass < 2; pass++) {
+		int start = pass == 0 ? hint : 1;
+		int end = pass == 0 ? super_blk->total_data_blk : hint + num_blk - 1;
+
+		if(end > super_blk->total_data_blk)
+			end = super_blk->total_data_blk;
+
+		/* jump from free entry to used entry */
+		for(int i = fat_find_free(file_alloc_table, start, end); i < end; i = fat_find_free(file_alloc_table, i, end)) {
+			int run_end = fat_find_used(file_alloc_table, i, end);
+
+			if(run_end - i >= num_blk)
+				return i;
+
+			i = run_end;
+		}
+	}
+
+	return -1;
+}
+
+/* get the file's all indexes */
+int* get_file_fat_indexes(int fd) {
+	int file_require_blk = get_num_file_blk(fd);
+	int current_index;
+	int* file_fat_indexes = malloc(sizeof(int) * file_require_blk);
+
+	file_fat_indexes[0] = fd_table[fd].file_dir_entry->ini_data_index;
+	current_index = file_fat_indexes[0];
+	for(int i = 1; i < file_require_blk; i++) {
+		file_fat_indexes[i] = file_alloc_table[current_index];
+		current_index = file_alloc_table[current_index];
+	}
+
+	return file_fat_indexes;
+}
+
+/* carve @num_blk blocks off the end of the data blocks, return the disk index of the first one */
+int reserve_tail_blk(int num_blk) {
+	int new_total = super_blk->total_data_blk - num_blk;
+
+	/* keep at least one usable data block besides the reserved FAT entry 0 */
+	if(new_total <= 1)
+		return -1;
+
+	/* the blocks must not belong to any file */
+	for(int i = new_total; i < super_blk->total_data_blk; i++) {
+		if(file_alloc_table[i] != 0 || (ref_count != NULL && !phys_blk_free(i)))
+			return -1;
+	}
+
+	for(int i = new_total; i < super_blk->total_data_blk; i++) {
+		discard_cancel(i);
+		cache_invalidate(i);
+	}
+
+	super_blk->total_data_blk = new_total;
+
+	return super_blk->data_index + new_total;
+}
+
+/* number of blocks of the compression map */
+int get_cmap_blk(void) {
+	return get_count_to_blk(super_blk->total_data_blk);
+}
+
+/* number of blocks of the checksum area */
+int get_crc_blk(void) {
+	return get_count_to_blk(super_blk->total_data_blk * sizeof(uint32_t));
+}
+
+/* number of blocks of the remap table */
+int get_remap_blk(void) {
+	return get_count_to_blk(super_blk->total_data_blk * sizeof(uint16_t));
+}
+
+/* read the @num_blk blocks starting at disk block @index into @area, in one request */
+int read_area(int index, int num_blk, void* area) {
+	size_t* blocks = malloc(sizeof(size_t) * num_blk);
+	int ret;
+
+	for(int i = 0; i < num_blk; i++)
+		blocks[i] = index + i;
+
+	ret = block_read_many(blocks, num_blk, area);
+	free(blocks);
+
+	return ret;
+}
+
+/* load a feature area of @num_blk blocks starting at disk block @index */
+void* load_area(int index, int num_blk) {
+	void* area = malloc(num_blk * BLOCK_SIZE);
+
+	if(read_area(index, num_blk, area) == -1) {
+		free(area);
+		area = NULL;
+	}
+
+	return area;
+}
+
+/* write back a feature area of @num_blk blocks starting at disk block @index */
+int store_area(int index, int num_blk, const void* area) {
+	size_t* blocks = malloc(sizeof(size_t) * num_blk);
+	int ret;
+
+	for(int i = 0; i < num_blk; i++)
+		blocks[i] = index + i;
+
+	ret = block_write_many(blocks, num_blk, area);
+	free(blocks);
+
+	return ret;
+}
+
+/* record the checksum of data blocks about to be written */
+void update_crc(const int* fat_indexes, int num_blk, const void* buf) {
+	if(crc_table == NULL)
+		return;
+
+	for(int i = 0; i < num_blk; i++) {
+		crc_table[fat_indexes[i]] = crc32c(0, buf + BLOCK_SIZE * i, BLOCK_SIZE);
+		mark_blk_dirty(fat_indexes[i]);
+	}
+}
+
+/* check data blocks just read from the disk against their checksum */
+int verify_crc(const int* fat_indexes, int num_blk, const void* buf) {
+	if(crc_table == NULL)
+		return 0;
+
+	for(int i = 0; i < num_blk; i++) {
+		uint32_t expected = crc_table[fat_indexes[i]];
+
+		if(expected != 0 && crc32c(0, buf + BLOCK_SIZE * i, BLOCK_SIZE) != expected) {
+			fprintf(stderr, "fs: checksum mismatch in data block %d\n", fat_indexes[i]);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* write the data block of a FAT entry straight to the disk, never sharing it */
+int data_blk_write(int fat_index, const void* buf) {
+	/* the content matters again */
+	if(log_fresh != NULL)
+		log_relocate(fat_index);
+	else
+		unshare_data_blk(fat_index);
+	discard_cancel(fat_index);
+	dedup_forget(get_phys_blk(fat_index));
+	update_crc(&fat_index, 1, buf);
+
+	return block_write(super_blk->data_index + get_phys_blk(fat_index), buf);
+}
+
+/* read the data blocks of @num_blk FAT entries in one batch */
+int data_blk_read_many(const int* fat_indexes, int num_blk, void* buf) {
+	size_t* blocks = malloc(sizeof(size_t) * num_blk);
+	int ret;
+
+	for(int i = 0; i < num_blk; i++)
+		blocks[i] = super_blk->data_index + get_phys_blk(fat_indexes[i]);
+
+	ret = block_read_many(blocks, num_blk, buf);
+	free(blocks);
+
+	if(ret == 0)
+		ret = verify_crc(fat_indexes, num_blk, buf);
+
+	/* blocks read from the disk tell the fingerprint index what they hold */
+	for(int i = 0; ret == 0 && dedup_index != NULL && i < num_blk; i++) {
+		int blk = get_phys_blk(fat_indexes[i]);
+
+		if(!dedup_index[blk].indexed && file_alloc_table[fat_indexes[i]] != FAT_PACK)
+			dedup_insert(blk, hash64(buf + BLOCK_SIZE * i, BLOCK_SIZE));
+	}
+
+	return ret;
+}
+
+/* find a block of data @buf among the first @num_written blocks of @written, -1 if none */
+int dedup_find_batch(const void* buf, uint64_t hash, const uint64_t* hashes, const uint8_t* written, int num_written) {
+	for(int i = 0; i < num_written; i++) {
+		if(hashes[i] == hash && memcmp(written + BLOCK_SIZE * i, buf, BLOCK_SIZE) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+/* write the data blocks of @num_blk FAT entries in one batch, sharing duplicated blocks */
+int data_blk_write_many(const int* fat_indexes, int num_blk, const void* buf) {
+	size_t* blocks = malloc(sizeof(size_t) * num_blk);
+	uint64_t* hashes = NULL;
+	uint8_t* written = NULL;
+	int* written_index = NULL;
+	int num_written = 0;
+	int ret;
+
+	/* with deduplication, only the blocks holding new content are gathered and written */
+	if(dedup_index != NULL) {
+		hashes = malloc(sizeof(uint64_t) * num_blk);
+		written = malloc(BLOCK_SIZE * num_blk);
+		written_index = malloc(sizeof(int) * num_blk);
+	}
+
+	for(int i = 0; i < num_blk; i++) {
+		const void* data = buf + BLOCK_SIZE * i;
+
+		if(dedup_index != NULL && file_alloc_table[fat_indexes[i]] != FAT_PACK) {
+			uint64_t hash = hash64(data, BLOCK_SIZE);
+			int blk;
+
+			/* the same content may come earlier in this batch or be on the disk already */
+			blk = dedup_find_batch(data, hash, hashes, written, num_written);
+			if(blk != -1)
+				blk = get_phys_blk(fat_indexes[written_index[blk]]);
+			else
+				blk = dedup_find(data, hash);
+
+			if(blk != -1) {
+				dedup_share(fat_indexes[i], blk);
+				update_crc(&fat_indexes[i], 1, data);
+				continue;
+			}
+
+			hashes[num_written] = hash;
+		}
+
+		if(log_fresh != NULL)
+			log_relocate(fat_indexes[i]);
+		else
+			unshare_data_blk(fat_indexes[i]);
+		discard_cancel(fat_indexes[i]);
+		dedup_forget(get_phys_blk(fat_indexes[i]));
+		update_crc(&fat_indexes[i], 1, data);
+
+		blocks[num_written] = super_blk->data_index + get_phys_blk(fat_indexes[i]);
+		if(written != NULL) {
+			memcpy(written + BLOCK_SIZE * num_written, data, BLOCK_SIZE);
+			written_index[num_written] = i;
+		}
+		num_written++;
+	}
+
+	ret = block_write_many(blocks, num_written, written != NULL ? written : buf);
+
+	/* the new content is on the disk: it can be shared from now on */
+	for(int i = 0; ret == 0 && written != NULL && i < num_written; i++) {
+		if(file_alloc_table[fat_indexes[written_index[i]]] != FAT_PACK)
+			dedup_insert(blocks[i] - super_blk->data_index, hashes[i]);
+	}
+
+	free(blocks);
+	free(hashes);
+	free(written);
+	free(written_index);
+
+	return ret;
+}
+
+/* give a data block back to the FAT */
+void release_data_blk(int fat_index) {
+	fat_set(fat_index, 0);
+	cache_invalidate(fat_index);
+
+	if(log_fresh != NULL)
+		log_fresh[fat_index] = 0;
+
+	if(comp_map != NULL)
+		comp_map[fat_index] = 0;
+
+	/* a block still used by a clone keeps its content */
+	if(ref_count == NULL || --ref_count[get_phys_blk(fat_index)] == 0) {
+		if(ref_count != NULL)
+			alloc.data_free++;
+		dedup_forget(get_phys_blk(fat_index));
+		discard_blk(fat_index);
+	}
+	else if(crc_table != NULL)
+		crc_table[fat_index] = 0;
+
+	if(remap_table != NULL)
+		remap_table[fat_index] = 0;
+}
+
+/* get the number of blocks in compression unit @unit of a @num_chain blocks file */
+int get_unit_len(int num_chain, int unit) {
+	int len = num_chain - unit * COMP_UNIT_BLK;
+
+	return len < COMP_UNIT_BLK ? len : COMP_UNIT_BLK;
+}
+
+/* inflate compressed unit @unit of the file into @out, and cache its blocks */
+int read_comp_unit(int* chain, int num_chain, int unit, uint8_t* out) {
+	int head = unit * COMP_UNIT_BLK;
+	int unit_len = get_unit_len(num_chain, unit);
+	uint32_t comp_len;
+
+	/* the compressed stream occupies the first blocks of the unit */
+	if(data_blk_read_many(chain + head, comp_map[chain[head]], comp_buf) == -1)
+		return -1;
+
+	memcpy(&comp_len, comp_buf, sizeof(comp_len));
+	if(comp_len > (uint32_t)comp_map[chain[head]] * BLOCK_SIZE - COMP_HDR_SIZE)
+		return -1;
+
+	int raw_len = lz_decompress(comp_buf + COMP_HDR_SIZE, comp_len, out, unit_len * BLOCK_SIZE);
+	if(raw_len == -1)
+		return -1;
+
+	memset(out + raw_len, 0, unit_len * BLOCK_SIZE - raw_len);
+
+	for(int i = 0; i < unit_len; i++)
+		cache_update(chain[head + i], out + BLOCK_SIZE * i);
+
+	return 0;
+}
+
+/* read @num_blk blocks of a file starting at its block @first, @chain lists the file's FAT indexes */
+int read_file_blks(int* chain, int num_chain, int first, int num_blk, void* buf) {
+	int* miss_indexes = malloc(sizeof(int) * num_blk);
+	int* miss_pos = malloc(sizeof(int) * num_blk);
+	void* miss_buf = NULL;
+	int num_miss = 0;
+	int ret = 0;
+
+	for(int i = first; i < first + num_blk; i++) {
+		void* blk_buf = buf + BLOCK_SIZE * (i - first);
+
+		if(cache_read(chain[i], blk_buf) == 0)
+			continue;
+
+		/* the block is part of a compressed unit: inflate the whole unit */
+		if(comp_map != NULL && comp_map[chain[i - i % COMP_UNIT_BLK]] != 0) {
+			if(read_comp_unit(chain, num_chain, i / COMP_UNIT_BLK, inflate_buf) == -1) {
+				ret = -1;
+				break;
+			}
+
+			memcpy(blk_buf, inflate_buf + BLOCK_SIZE * (i % COMP_UNIT_BLK), BLOCK_SIZE);
+			continue;
+		}
+
+		miss_indexes[num_miss] = chain[i];
+		miss_pos[num_miss] = i - first;
+		num_miss++;
+	}
+
+	/* fetch all the missing blocks in one batch */
+	if(ret == 0 && num_miss > 0) {
+		miss_buf = malloc(BLOCK_SIZE * num_miss);
+		ret = data_blk_read_many(miss_indexes, num_miss, miss_buf);
+
+		for(int i = 0; ret == 0 && i < num_miss; i++) {
+			memcpy(buf + BLOCK_SIZE * miss_pos[i], miss_buf + BLOCK_SIZE * i, BLOCK_SIZE);
+			cache_update(miss_indexes[i], miss_buf + BLOCK_SIZE * i);
+		}
+	}
+
+	free(miss_indexes);
+	free(miss_pos);
+	free(miss_buf);
+
+	return ret;
+}
+
+/* store the content of a whole compression unit, packed if it's worth it */
+int write_comp_unit(int* chain, int num_chain, int unit, int was_comp, int first, int num_blk) {
+	int head = unit * COMP_UNIT_BLK;
+	int unit_len = get_unit_len(num_chain, unit);
+	int comp_len = -1;
+	int comp_blk;
+
+	/* packing is only useful if it saves at least one block */
+	if(unit_len > 1)
+		comp_len = lz_compress(unit_buf, unit_len * BLOCK_SIZE, comp_buf + COMP_HDR_SIZE, (unit_len - 1) * BLOCK_SIZE - COMP_HDR_SIZE);
+
+	if(comp_len == -1) {
+		/* store the unit raw, blocks that were packed must all be rewritten */
+		for(int i = 0; i < unit_len; i++) {
+			if(!was_comp && (head + i < first || head + i >= first + num_blk))
+				continue;
+
+			if(data_blk_write(chain[head + i], unit_buf + BLOCK_SIZE * i) == -1)
+				return -1;
+		}
+
+		comp_map[chain[head]] = 0;
+		mark_blk_dirty(chain[head]);
+	} else {
+		uint32_t header[2] = { comp_len, unit_len * BLOCK_SIZE };
+
+		memcpy(comp_buf, header, sizeof(header));
+		comp_blk = get_count_to_blk(COMP_HDR_SIZE + comp_len);
+		memset(comp_buf + COMP_HDR_SIZE + comp_len, 0, comp_blk * BLOCK_SIZE - COMP_HDR_SIZE - comp_len);
+
+		if(data_blk_write_many(chain + head, comp_blk, comp_buf) == -1)
+			return -1;
+
+		/* the rest of the unit holds nothing */
+		for(int i = comp_blk; i < unit_len; i++)
+			discard_blk(chain[head + i]);
+
+		comp_map[chain[head]] = comp_blk;
+		mark_blk_dirty(chain[head]);
+	}
+
+	for(int i = 0; i < unit_len; i++)
+		cache_update(chain[head + i], unit_buf + BLOCK_SIZE * i);
+
+	return 0;
+}
+
+/* write @num_blk blocks of a file starting at its block @first, @chain lists the file's FAT indexes */
+int write_file_blks(int* chain, int num_chain, int first, int num_blk, const void* buf) {
+	if(comp_map == NULL) {
+		if(data_blk_write_many(chain + first, num_blk, buf) == -1)
+			return -1;
+
+		for(int i = first; i < first + num_blk; i++)
+			cache_update(chain[i], buf + BLOCK_SIZE * (i - first));
+
+		return 0;
+	}
+
+	/* compressed units are rewritten as a whole */
+	for(int unit = first / COMP_UNIT_BLK; unit * COMP_UNIT_BLK < first + num_blk; unit++) {
+		int head = unit * COMP_UNIT_BLK;
+		int unit_len = get_unit_len(num_chain, unit);
+		int was_comp = comp_map[chain[head]] != 0;
+
+		/* gather the current content of the blocks that are not overwritten */
+		if(head < first || head + unit_len > first + num_blk) {
+			if(was_comp) {
+				if(read_comp_unit(chain, num_chain, unit, unit_buf) == -1)
+					return -1;
+			} else {
+				for(int i = head; i < head + unit_len; i++) {
+					if(i >= first && i < first + num_blk)
+						continue;
+
+					if(read_file_blks(chain, num_chain, i, 1, unit_buf + BLOCK_SIZE * (i - head)) == -1)
+						return -1;
+				}
+			}
+		}
+
+		for(int i = head; i < head + unit_len; i++) {
+			if(i >= first && i < first + num_blk)
+				memcpy(unit_buf + BLOCK_SIZE * (i - head), buf + BLOCK_SIZE * (i - first), BLOCK_SIZE);
+		}
+
+		if(write_comp_unit(chain, num_chain, unit, was_comp, first, num_blk) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* write @count bytes at byte @offset of a file, @chain lists the file's FAT indexes */
+int write_file_range(int* chain, int num_chain, int offset, const void* buf, int count) {
+	int first_blk = offset / BLOCK_SIZE;
+	int last_blk = (offset + count - 1) / BLOCK_SIZE;
+	int num_blk = last_blk - first_blk + 1;
+	void* tmp_buf;
+	int ret = 0;
+
+	if(count <= 0)
+		return 0;
+
+	tmp_buf = malloc(num_blk * BLOCK_SIZE);
+
+	/* blocks only partially overwritten keep the rest of their content */
+	if(offset % BLOCK_SIZE != 0)
+		ret = read_file_blks(chain, num_chain, first_blk, 1, tmp_buf);
+
+	if(ret == 0 && (offset + count) % BLOCK_SIZE != 0 && (last_blk != first_blk || offset % BLOCK_SIZE == 0))
+		ret = read_file_blks(chain, num_chain, last_blk, 1, tmp_buf + BLOCK_SIZE * (num_blk - 1));
+
+	if(ret == 0) {
+		memcpy(tmp_buf + offset % BLOCK_SIZE, buf, count);
+		ret = write_file_blks(chain, num_chain, first_blk, num_blk, tmp_buf);
+	}
+
+	free(tmp_buf);
+
+	return ret;
+}
+
+/* find room for @size bytes in packed block @blk, return its offset or -1 */
+int find_pack_offset(int blk, int size) {
+	int pos = 0;
+	int moved = 1;
+
+	/* first fit: skip past every file overlapping the candidate position */
+	while(moved && pos + size <= BLOCK_SIZE) {
+		moved = 0;
+
+		for(int j = 0; j < FS_FILE_MAX_COUNT; j++) {
+			int start = root_dir[j].pack_offset;
+			int end = start + root_dir[j].file_size;
+
+			if(root_dir[j].pack_index == blk && start < pos + size && end > pos) {
+				pos = end;
+				moved = 1;
+			}
+		}
+	}
+
+	return pos + size <= BLOCK_SIZE ? pos : -1;
+}
+
+/* find room for @size bytes in a packed block, return the block and set @offset */
+int find_pack_slot(int size, int* offset) {
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		int blk = root_dir[i].pack_index;
+		int pos;
+
+		/* look at each packed block once, from its first file */
+		if(blk == 0)
+			continue;
+
+		for(int j = 0; j < i && blk != 0; j++) {
+			if(root_dir[j].pack_index == blk)
+				blk = 0;
+		}
+
+		if(blk == 0)
+			continue;
+
+		pos = find_pack_offset(blk, size);
+		if(pos != -1) {
+			*offset = pos;
+			return blk;
+		}
+	}
+
+	return -1;
+}
+
+/* the file of a directory entry leaves its packed block, which is freed once empty */
+void pack_release(struct root_directory* entry) {
+	int blk = entry->pack_index;
+
+	entry->pack_index = 0;
+	entry->pack_offset = 0;
+
+	if(blk == 0)
+		return;
+
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if(root_dir[i].pack_index == blk)
+			return;
+	}
+
+	release_data_blk(blk);
+}
+
+/* free the blocks of a file and its root_dir entry */
+void delete_entry(struct root_directory* entry) {
+	/* start dealing with the FAT deallocation */
+	uint16_t cur_fat_entry = entry->ini_data_index;
+
+	if(cur_fat_entry != FAT_EOC) {
+		/* making sure that the file is not an empty file */
+		while(file_alloc_table[cur_fat_entry] != FAT_EOC) {
+			uint16_t next_fat_entry = file_alloc_table[cur_fat_entry];
+
+			release_data_blk(cur_fat_entry);
+
+			cur_fat_entry = next_fat_entry;
+		}
+
+		release_data_blk(cur_fat_entry);
+	}
+
+	pack_release(entry);
+
+	/* deal with the root_dir reset */
+	set_file_name(entry, "");
+	entry->file_size = 0;
+	entry->ini_data_index = 0;
+
+	mark_dir_dirty(entry);
+}
+
+/* read packed block @blk */
+int read_pack_blk(int blk, void* blk_buf) {
+	return read_file_blks(&blk, 1, 0, 1, blk_buf);
+}
+
+/*
+ * store the @size bytes of the file of a directory entry packed with other small files
+ * return 1 once stored, 0 when no block has room for them, -1 in case of I/O error
+ */
+int write_packed(struct root_directory* entry, const void* data, int size) {
+	uint8_t blk_buf[BLOCK_SIZE];
+	int old_blk = entry->pack_index;
+	int old_offset = entry->pack_offset;
+	int offset = 0;
+	int blk;
+
+	/* the file's current place is free for its new content */
+	entry->pack_index = 0;
+	blk = find_pack_slot(size, &offset);
+
+	/* alone in its block, the file is found by no other one */
+	if(blk == -1 && old_blk != 0) {
+		int pos = find_pack_offset(old_blk, size);
+
+		if(pos != -1) {
+			blk = old_blk;
+			offset = pos;
+		}
+	}
+
+	if(blk != -1) {
+		if(read_pack_blk(blk, blk_buf) == -1) {
+			entry->pack_index = old_blk;
+			return -1;
+		}
+	} else if(get_fat_free() > 0) {
+		int* free_index = get_free_fat_indexes(1);
+
+		blk = free_index[0];
+		free(free_index);
+		fat_set(blk, FAT_PACK);
+		memset(blk_buf, 0, BLOCK_SIZE);
+	} else {
+		entry->pack_index = old_blk;
+		return 0;
+	}
+
+	memcpy(blk_buf + offset, data, size);
+	if(data_blk_write(blk, blk_buf) == -1) {
+		entry->pack_index = old_blk;
+		return -1;
+	}
+
+	cache_update(blk, blk_buf);
+
+	/* leave the old block, which may be empty now */
+	entry->pack_index = old_blk;
+	entry->pack_offset = old_offset;
+	if(old_blk != blk)
+		pack_release(entry);
+
+	entry->pack_index = blk;
+	entry->pack_offset = offset;
+	entry->file_size = size;
+
+	return 1;
+}
+
+/* move a packed file to a data block of its own */
+int unpack_file(struct root_directory* entry) {
+	uint8_t blk_buf[BLOCK_SIZE];
+	uint8_t data[PACK_MAX_SIZE];
+	int* free_index;
+	int blk;
+
+	if(get_fat_free() == 0 || read_pack_blk(entry->pack_index, blk_buf) == -1)
+		return -1;
+
+	memcpy(data, blk_buf + entry->pack_offset, entry->file_size);
+	memset(blk_buf, 0, BLOCK_SIZE);
+	memcpy(blk_buf, data, entry->file_size);
+
+	free_index = get_free_fat_indexes(1);
+	blk = free_index[0];
+	free(free_index);
+
+	fat_set(blk, FAT_EOC);
+	if(write_file_blks(&blk, 1, 0, 1, blk_buf) == -1) {
+		release_data_blk(blk);
+		return -1;
+	}
+
+	pack_release(entry);
+	entry->ini_data_index = blk;
+
+	return 0;
+}
+
+/* size of the largest possible journal group, in blocks */
+int get_journal_group_blk(void) {
+	int capacity = BLOCK_SIZE - sizeof(struct journal_header);
+	int blk_per_blk = capacity / sizeof(struct journal_blk_rec);
+	int dir_per_blk = capacity / sizeof(struct journal_dir_rec);
+
+	/* a group holds at most one record per data block and per directory slot */
+	return (super_blk->total_data_blk + blk_per_blk - 1) / blk_per_blk + (FS_FILE_MAX_COUNT + dir_per_blk - 1) / dir_per_blk + 1;
+}
+
+/* write the FAT, root directory and feature areas */
+int flush_metadata(void) {
+	/* the root directory follows the FAT on disk as in memory */
+	if(store_area(1, super_blk->total_FAT_blk + 1, file_alloc_table) == -1)
+		return -1;
+
+	if(comp_map != NULL && store_area(super_blk->cmap_index, get_cmap_blk(), comp_map) == -1)
+		return -1;
+
+	if(crc_table != NULL && store_area(super_blk->crc_index, get_crc_blk(), crc_table) == -1)
+		return -1;
+
+	if(remap_table != NULL && store_area(super_blk->remap_index, get_remap_blk(), remap_table) == -1)
+		return -1;
+
+	return 0;
+}
+
+/* apply the metadata records of one journal block */
+void journal_apply(const uint8_t* blk) {
+	struct journal_header header;
+	int pos = sizeof(header);
+
+	memcpy(&header, blk, sizeof(header));
+
+	while(pos < (int)sizeof(header) + header.used) {
+		if(blk[pos] == JREC_BLK) {
+			struct journal_blk_rec rec;
+
+			memcpy(&rec, blk + pos, sizeof(rec));
+			pos += sizeof(rec);
+
+			if(rec.fat_index >= super_blk->total_data_blk)
+				continue;
+
+			file_alloc_table[rec.fat_index] = rec.fat_value;
+			if(comp_map != NULL)
+				comp_map[rec.fat_index] = rec.comp_blk;
+			if(crc_table != NULL)
+				crc_table[rec.fat_index] = rec.crc;
+			if(remap_table != NULL)
+				remap_table[rec.fat_index] = rec.remap;
+		} else if(blk[pos] == JREC_DIR) {
+			struct journal_dir_rec rec;
+
+			memcpy(&rec, blk + pos, sizeof(rec));
+			pos += sizeof(rec);
+
+			if(rec.slot < FS_FILE_MAX_COUNT)
+				root_dir[rec.slot] = rec.entry;
+		} else {
+			break;
+		}
+	}
+}
+
+/* a journal block is valid if it belongs to group @seq and is intact */
+int journal_blk_valid(uint8_t* blk, uint32_t seq) {
+	struct journal_header header;
+	uint32_t crc;
+
+	memcpy(&header, blk, sizeof(header));
+	if(header.magic != JOURNAL_MAGIC || header.seq != seq || header.used > BLOCK_SIZE - sizeof(header))
+		return 0;
+
+	crc = header.crc;
+	header.crc = 0;
+	memcpy(blk, &header, sizeof(header));
+
+	return crc32c(0, blk, BLOCK_SIZE) == crc;
+}
+
+/* apply every complete group left in the journal, return how many */
+int journal_replay(void) {
+	uint8_t* journal = load_area(super_blk->journal_index, super_blk->journal_blk);
+	uint32_t seq = super_blk->journal_seq;
+	int num_group = 0;
+	int group_start = 0;
+
+	if(journal == NULL)
+		return -1;
+
+	for(int i = 0; i < super_blk->journal_blk; i++) {
+		struct journal_header header;
+
+		if(!journal_blk_valid(journal + BLOCK_SIZE * i, seq))
+			break;
+
+		memcpy(&header, journal + BLOCK_SIZE * i, sizeof(header));
+		if(!header.commit)
+			continue;
+
+		/* the whole group made it to the disk */
+		for(int j = group_start; j <= i; j++)
+			journal_apply(journal + BLOCK_SIZE * j);
+
+		num_group++;
+		group_start = i + 1;
+		seq++;
+	}
+
+	journal_next_seq = seq;
+	free(journal);
+
+	return num_group;
+}
+
+/* write all the metadata in place and empty the journal */
+int journal_checkpoint(void) {
+	if(flush_metadata() == -1 || block_sync() == -1)
+		return -1;
+
+	/* the groups in the journal are now obsolete */
+	super_blk->journal_seq = journal_next_seq;
+	if(block_write(0, super_blk) == -1 || block_sync() == -1)
+		return -1;
+
+	journal_head = 0;
+	memset(jdirty_blk, 0, (super_blk->total_data_blk + 7) / 8);
+	memset(jdirty_dir, 0, sizeof(jdirty_dir));
+	journal_ops = 0;
+
+	/* releases are on disk now */
+	discard_flush();
+
+	return 0;
+}
+
+/* append one record to the group being built in @group */
+void journal_add(uint8_t* group, int* num_blk, const void* rec, int size) {
+	struct journal_header header;
+	uint8_t* blk = group + BLOCK_SIZE * (*num_blk - 1);
+
+	if(*num_blk > 0)
+		memcpy(&header, blk, sizeof(header));
+
+	/* records don't span blocks */
+	if(*num_blk == 0 || sizeof(header) + header.used + size > BLOCK_SIZE) {
+		(*num_blk)++;
+		blk = group + BLOCK_SIZE * (*num_blk - 1);
+		memset(blk, 0, BLOCK_SIZE);
+		memset(&header, 0, sizeof(header));
+		header.magic = JOURNAL_MAGIC;
+		header.seq = journal_next_seq;
+	}
+
+	memcpy(blk + sizeof(header) + header.used, rec, size);
+	header.used += size;
+	memcpy(blk, &header, sizeof(header));
+}
+
+/* group commit: log the dirty metadata and make it durable with a single sync */
+int journal_commit(void) {
+	uint8_t* group = malloc(get_journal_group_blk() * BLOCK_SIZE);
+	size_t* blocks;
+	int num_blk = 0;
+	int ret;
+
+	for(int i = 0; i < super_blk->total_data_blk; i++) {
+		if(jdirty_blk[i / 8] & (1 << (i % 8))) {
+			struct journal_blk_rec rec = { JREC_BLK, 0, i, file_alloc_table[i], 0, 0 };
+
+			if(comp_map != NULL)
+				rec.comp_blk = comp_map[i];
+			if(crc_table != NULL)
+				rec.crc = crc_table[i];
+			if(remap_table != NULL)
+				rec.remap = remap_table[i];
+
+			journal_add(group, &num_blk, &rec, sizeof(rec));
+		}
+	}
+
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if(jdirty_dir[i / 8] & (1 << (i % 8))) {
+			struct journal_dir_rec rec = { JREC_DIR, i, root_dir[i] };
+
+			journal_add(group, &num_blk, &rec, sizeof(rec));
+		}
+	}
+
+	journal_ops = 0;
+
+	/* everything is in the journal already, the pinned blocks' moves included */
+	if(num_blk == 0) {
+		free(group);
+		log_unpin_all();
+		return 0;
+	}
+
+	/* seal the blocks, the last one closes the group */
+	blocks = malloc(sizeof(size_t) * num_blk);
+	for(int i = 0; i < num_blk; i++) {
+		struct journal_header header;
+		uint8_t* blk = group + BLOCK_SIZE * i;
+
+		memcpy(&header, blk, sizeof(header));
+		header.commit = (i == num_blk - 1);
+		memcpy(blk, &header, sizeof(header));
+
+		header.crc = crc32c(0, blk, BLOCK_SIZE);
+		memcpy(blk, &header, sizeof(header));
+
+		blocks[i] = super_blk->journal_index + journal_head + i;
+	}
+
+	/* data blocks were written before, the sync covers them as well */
+	ret = block_write_many(blocks, num_blk, group);
+	if(ret == 0)
+		ret = block_sync();
+
+	free(blocks);
+	free(group);
+
+	if(ret == -1)
+		return -1;
+
+	journal_head += num_blk;
+	journal_next_seq++;
+	memset(jdirty_blk, 0, (super_blk->total_data_blk + 7) / 8);
+	memset(jdirty_dir, 0, sizeof(jdirty_dir));
+
+	/* the moves away from the pinned blocks are committed */
+	log_unpin_all();
+
+	/* make sure the next group fits, memory matches the journal right now */
+	if(super_blk->journal_blk - journal_head < get_journal_group_blk())
+		return journal_checkpoint();
+
+	if(discard_count >= DISCARD_BATCH)
+		discard_flush();
+
+	return 0;
+}
+
+/* end of a metadata operation: commit the group once it is large enough */
+int journal_op_end(void) {
+	if(jdirty_blk == NULL)
+		return 0;
+
+	if(++journal_ops < JOURNAL_GROUP_OPS)
+		return 0;
+
+	return journal_commit();
+}
+
+/* get the list of FAT indexes of the file of a root directory entry, and its length */
+int* get_entry_fat_indexes(struct root_directory* entry, int* num_blk) {
+	int* chain;
+	int count = 0;
+
+	for(int i = entry->ini_data_index; i != FAT_EOC; i = file_alloc_table[i])
+		count++;
+
+	chain = malloc(sizeof(int) * (count > 0 ? count : 1));
+	count = 0;
+	for(int i = entry->ini_data_index; i != FAT_EOC; i = file_alloc_table[i])
+		chain[count++] = i;
+
+	*num_blk = count;
+
+	return chain;
+}
+
+/* count the runs of consecutive blocks in a chain */
+int get_num_extent(const int* chain, int num_blk) {
+	int result = num_blk > 0;
+
+	for(int i = 1; i < num_blk; i++) {
+		if(chain[i] != chain[i - 1] + 1)
+			result++;
+	}
+
+	return result;
+}
+
+/* move block @i of a file to the free FAT entry @target */
+int move_file_blk(struct root_directory* entry, int* chain, int i, int target) {
+	int old_index = chain[i];
+	int head = i - i % COMP_UNIT_BLK;
+	uint8_t blk_buf[BLOCK_SIZE];
+
+	/* the end of a packed unit holds nothing worth copying */
+	int stored = comp_map == NULL || comp_map[chain[head]] == 0 || i - head < comp_map[chain[head]];
+
+	if(ref_count != NULL && ref_count[get_phys_blk(old_index)] > 1) {
+		/* a shared block keeps being shared, only the FAT entry moves */
+		set_phys_blk(target, get_phys_blk(old_index));
+		if(crc_table != NULL)
+			crc_table[target] = crc_table[old_index];
+	} else {
+		claim_data_blk(target);
+
+		if(stored) {
+			/* the chain is untouched yet, the new entry only has to be given back */
+			if(data_blk_read_many(&old_index, 1, blk_buf) == -1 || data_blk_write(target, blk_buf) == -1) {
+				release_data_blk(target);
+				return -1;
+			}
+		} else if(crc_table != NULL) {
+			crc_table[target] = 0;
+		}
+	}
+
+	if(comp_map != NULL)
+		comp_map[target] = comp_map[old_index];
+
+	/* splice the new entry into the chain in place of the old one */
+	fat_set(target, file_alloc_table[old_index]);
+	if(i == 0) {
+		entry->ini_data_index = target;
+		mark_dir_dirty(entry);
+	} else {
+		fat_set(chain[i - 1], target);
+	}
+
+	/* the old entry stays taken until the new chain is on disk, see fs_defrag() */
+	chain[i] = target;
+
+	return 0;
+}
+
+/*
+ * make one file more contiguous by moving at most @budget blocks, counted in @moved
+ * even when a move fails; the FAT entries moved away from are stored in
+ * @old_index, still taken
+ */
+int defrag_file(struct root_directory* entry, int budget, int* old_index, int* moved) {
+	int num_blk;
+	int* chain = get_entry_fat_indexes(entry, &num_blk);
+	int ret = 0;
+
+	*moved = 0;
+	for(int i = 1; i < num_blk && *moved < budget; i++) {
+		int target = chain[i - 1] + 1;
+
+		if(chain[i] == target)
+			continue;
+
+		/* the way is blocked: start over in a free run large enough for the whole file */
+		if(target >= super_blk->total_data_blk || file_alloc_table[target] != 0) {
+			int run_start = find_free_run(num_blk, 1);
+
+			if(run_start == -1)
+				break;
+
+			i = 0;
+			target = run_start;
+		}
+
+		old_index[*moved] = chain[i];
+		if(move_file_blk(entry, chain, i, target) == -1) {
+			ret = -1;
+			break;
+		}
+
+		(*moved)++;
+	}
+
+	free(chain);
+
+	return ret;
+}
+
+/* earse all allocated data structures */
+void clean_FS(void) {
+	free(meta_area);
+	meta_area = NULL;
+	super_blk = NULL;
+	root_dir = NULL;
+	file_alloc_table = NULL;
+	free(discard_map);
+	free(comp_map);
+	free(crc_table);
+	free(jdirty_blk);
+	free(remap_table);
+	free(ref_count);
+	free(dedup_index);
+	free(dedup_bucket);
+	free(log_fresh);
+	free(log_pinned);
+	comp_map = NULL;
+	crc_table = NULL;
+	jdirty_blk = NULL;
+	remap_table = NULL;
+	ref_count = NULL;
+	dedup_index = NULL;
+	dedup_bucket = NULL;
+	log_fresh = NULL;
+	log_pinned = NULL;
+	log_pinned_count = 0;
+	cache_destroy();
+}
+
+/* set all the FD's root_dir pointer to NULL */
+void init_fd_table(void) {
+	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		fd_table[i].file_dir_entry = NULL;
+		fd_table[i].offset = 0;
+		fd_table[i].buffered = 0;
+		fd_table[i].dirty_buf = NULL;
+		fd_table[i].dirty_len = 0;
+		fd_table[i].dirty_cap = 0;
+		fd_table[i].advice = FS_ADV_NORMAL;
+		fd_table[i].ra_next = 0;
+		fd_table[i].ra_window = 0;
+		fd_table[i].ra_end = 0;
+	}
+}
+
+/* size of a file, counting the data still held by buffered descriptors */
+int get_file_size(struct root_directory* entry) {
+	int result = entry->file_size;
+
+	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if(fd_table[i].file_dir_entry == entry && fd_table[i].dirty_len > 0 && fd_table[i].dirty_start + fd_table[i].dirty_len > result)
+			result = fd_table[i].dirty_start + fd_table[i].dirty_len;
+	}
+
+	return result;
+}
+
+/* number of blocks to read ahead of a read of the file of @fd ending before its block @end */
+int get_readahead(int fd, int first, int end) {
+	struct file_descriptor* desc = &fd_table[fd];
+	int num_blk = get_count_to_blk(desc->file_dir_entry->file_size);
+	/* small sequential reads start in the block the previous one ended in */
+	int sequential = first == desc->ra_next || first + 1 == desc->ra_next;
+	int result;
+
+	if(desc->advice == FS_ADV_RANDOM) {
+		desc->ra_window = 0;
+	} else if(desc->advice == FS_ADV_SEQUENTIAL) {
+		desc->ra_window = READAHEAD_MAX_BLK;
+	} else if(sequential) {
+		desc->ra_window = desc->ra_window == 0 ? READAHEAD_MIN_BLK : desc->ra_window * 2;
+		if(desc->ra_window > READAHEAD_MAX_BLK)
+			desc->ra_window = READAHEAD_MAX_BLK;
+	} else {
+		desc->ra_window = 0;
+		desc->ra_end = 0;
+	}
+
+	desc->ra_next = end;
+
+	/* the blocks read ahead last time are still in the cache */
+	if(desc->ra_window == 0 || end < desc->ra_end)
+		return 0;
+
+	result = num_blk - end < desc->ra_window ? num_blk - end : desc->ra_window;
+	if(result < 0)
+		result = 0;
+
+	desc->ra_end = end + result;
+
+	return result;
+}
+
+/* let the blocks holding @count bytes at @offset in the file of @fd be evicted first */
+void demote_file_range(int fd, int offset, int count) {
+	int* file_fat_indexes;
+
+	if(count <= 0 || fd_table[fd].file_dir_entry->pack_index != 0 || fd_table[fd].file_dir_entry->ini_data_index == FAT_EOC)
+		return;
+
+	file_fat_indexes = get_file_fat_indexes(fd);
+	for(int i = offset / BLOCK_SIZE; i <= (offset + count - 1) / BLOCK_SIZE; i++)
+		cache_demote(file_fat_indexes[i]);
+
+	free(file_fat_indexes);
+}
+
+/* delayed allocation: write the data held by a buffered descriptor, the file's final size known */
+int fd_flush(int fd) {
+	int start = fd_table[fd].dirty_start;
+	int len = fd_table[fd].dirty_len;
+	int saved_offset = fd_table[fd].offset;
+	int ret;
+
+	if(len == 0)
+		return 0;
+
+	/* nothing is dirty anymore for the operations below */
+	fd_table[fd].dirty_len = 0;
+
+	/* reserve the missing blocks as one run when possible, unless the file stays packed */
+	if(!(super_blk->features & FS_FEAT_TAILPACK) || start + len > PACK_MAX_SIZE) {
+		if(start + len > (int)fd_table[fd].file_dir_entry->file_size)
+			fs_fallocate(fd, start + len);
+	}
+
+	/* one plain write of the whole range */
+	fd_table[fd].buffered = 0;
+	fd_table[fd].offset = start;
+	ret = fs_write(fd, fd_table[fd].dirty_buf, len);
+	fd_table[fd].buffered = 1;
+	fd_table[fd].offset = saved_offset;
+
+	return ret == len ? 0 : -1;
+}
+
+/* write the data buffered for a file by any descriptor */
+int flush_entry(struct root_directory* entry) {
+	int ret = 0;
+
+	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if(fd_table[i].file_dir_entry == entry && fd_flush(i) == -1)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+/* write the data buffered by all descriptors */
+int flush_all(void) {
+	int ret = 0;
+
+	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if(fd_table[i].file_dir_entry != NULL && fd_flush(i) == -1)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+/* keep written data in the descriptor's buffer, merged with what it holds already */
+int buffer_write(int fd, const void* buf, size_t count) {
+	int offset = fd_table[fd].offset;
+	int end;
+
+	/* only one descriptor buffers data for a file at a time */
+	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if(i != fd && fd_table[i].file_dir_entry == fd_table[fd].file_dir_entry && fd_flush(i) == -1)
+			return -1;
+	}
+
+	/* the new data must overlap or extend the buffered range */
+	if(fd_table[fd].dirty_len > 0 && (offset < fd_table[fd].dirty_start || offset > fd_table[fd].dirty_start + fd_table[fd].dirty_len || offset + count - fd_table[fd].dirty_start > DELALLOC_MAX_SIZE)) {
+		if(fd_flush(fd) == -1)
+			return -1;
+	}
+
+	if(fd_table[fd].dirty_len == 0)
+		fd_table[fd].dirty_start = offset;
+
+	/* larger writes than the buffer go straight through */
+	if(offset + count - fd_table[fd].dirty_start > DELALLOC_MAX_SIZE) {
+		int ret;
+
+		fd_table[fd].buffered = 0;
+		ret = fs_write(fd, (void*)buf, count);
+		fd_table[fd].buffered = 1;
+
+		return ret;
+	}
+
+	end = offset + count - fd_table[fd].dirty_start;
+	if(end > fd_table[fd].dirty_cap) {
+		int cap = fd_table[fd].dirty_cap > 0 ? fd_table[fd].dirty_cap : BLOCK_SIZE;
+
+		while(cap < end)
+			cap *= 2;
+
+		fd_table[fd].dirty_buf = realloc(fd_table[fd].dirty_buf, cap);
+		fd_table[fd].dirty_cap = cap;
+	}
+
+	memcpy(fd_table[fd].dirty_buf + offset - fd_table[fd].dirty_start, buf, count);
+	if(end > fd_table[fd].dirty_len)
+		fd_table[fd].dirty_len = end;
+
+	fd_table[fd].offset = offset + count;
+
+	return count;
+}
+
+/* 
+*	library functions
+*/
+int fs_format(const char *diskname, size_t data_blk_count)
+{
+	struct super_block* sb;
+	size_t fat_blk;
+	size_t meta_blk;
+	size_t* blocks;
+	uint8_t* meta;
+	int ret;
+
+	/* ERROR CHECKING */
+	if(mount_flag == 1 || data_blk_count < 2 || data_blk_count > FS_MAX_BLOCKS)
+		return -1;
+
+	/* super block, FAT and root directory come first */
+	fat_blk = get_count_to_blk(data_blk_count * sizeof(uint16_t));
+	meta_blk = 1 + fat_blk + 1;
+	if(meta_blk + data_blk_count > FS_MAX_BLOCKS)
+		return -1;
+
+	/* SAFE TO PROCEED */
+	if(block_disk_create(diskname, meta_blk + data_blk_count) == -1 || block_disk_open(diskname) == -1)
+		return -1;
+
+	meta = calloc(meta_blk, BLOCK_SIZE);
+	blocks = malloc(sizeof(size_t) * meta_blk);
+
+	sb = (struct super_block*)meta;
+	memcpy(sb->signature, "ECS150FS", 8);
+	sb->total_virtual_blk = meta_blk + data_blk_count;
+	sb->root_dir_index = 1 + fat_blk;
+	sb->data_index = 2 + fat_blk;
+	sb->total_data_blk = data_blk_count;
+	sb->total_FAT_blk = fat_blk;
+
+	/* FAT entry 0 is never used */
+	((uint16_t*)(meta + BLOCK_SIZE))[0] = FAT_EOC;
+
+	for(size_t i = 0; i < meta_blk; i++)
+		blocks[i] = i;
+
+	/* the empty root directory is zeroed already, all the metadata goes out in one batch */
+	ret = block_write_many(blocks, meta_blk, meta);
+	if(ret == 0)
+		ret = block_sync();
+
+	free(blocks);
+	free(meta);
+
+	if(block_disk_close() == -1)
+		return -1;
+
+	return ret;
+}
+
+int fs_mount(const char *diskname)
+{
+	/* a temporary pointer to the signiture */
+	uint8_t* sig_tmp;
+	struct super_block sb;
+
+	/* initialize the FD table */
+	init_fd_table();
+
+	/* open up the virtual disk */
+	/* return -1 if the disk cannot be open */
+	if(block_disk_open(diskname) == -1)
+		return -1;
+
+	/* ERROR CHECKING */
+	if(block_read(0, &sb) == -1)
+		return -1;
+
+	/* the FAT and the root directory are loaded right after the super block */
+	if(sb.root_dir_index != sb.total_FAT_blk + 1)
+		return -1;
+
+	/* SAFE TO PROCEED */
+	/* super block, FAT and root directory are used in place, in one cache-aligned area */
+	meta_area = aligned_alloc(CACHE_LINE_SIZE, (sb.root_dir_index + 1) * BLOCK_SIZE);
+	if(meta_area == NULL)
+		return -1;
+
+	super_blk = (struct super_block*)meta_area;
+	file_alloc_table = (uint16_t*)(meta_area + BLOCK_SIZE);
+	root_dir = (struct root_directory*)(meta_area + sb.root_dir_index * BLOCK_SIZE);
+
+	memcpy(super_blk, &sb, BLOCK_SIZE);
+	if(read_area(1, sb.root_dir_index, file_alloc_table) == -1)
+		return -1;
+
+	/* nothing is waiting to be discarded yet */
+	discard_map = calloc((super_blk->total_data_blk + 7) / 8, 1);
+	discard_count = 0;
+
+	if(cache_init(super_blk->total_data_blk) == -1)
+		return -1;
+
+	/* ERROR CHECKING */
+	/* 1. check for signiture */
+	sig_tmp = super_blk->signature;
+	if(
+		sig_tmp[0] != 'E' || 
+		sig_tmp[1] != 'C' ||
+		sig_tmp[2] != 'S' ||
+		sig_tmp[3] != '1' ||
+		sig_tmp[4] != '5' ||
+		sig_tmp[5] != '0' ||
+		sig_tmp[6] != 'F' ||
+		sig_tmp[7] != 'S'
+	) return -1;
+
+	/* 2. check for block_disk_count */
+	if(super_blk->total_virtual_blk != block_disk_count())
+		return -1;
+
+	/* 3. refuse features we don't know how to handle */
+	if(super_blk->features & ~FS_FEAT_ALL)
+		return -1;
+
+	/* 4. FAT entries must point at data blocks or be special values */
+	if(fat_find_invalid(file_alloc_table, super_blk->total_data_blk, super_blk->total_data_blk, FAT_PACK) != super_blk->total_data_blk)
+		return -1;
+
+	/* load the feature areas */
+	if(super_blk->features & FS_FEAT_COMPRESS) {
+		comp_map = load_area(super_blk->cmap_index, get_cmap_blk());
+		if(comp_map == NULL)
+			return -1;
+	}
+
+	if(super_blk->features & FS_FEAT_CRC32C) {
+		crc_table = load_area(super_blk->crc_index, get_crc_blk());
+		if(crc_table == NULL)
+			return -1;
+	}
+
+	if(super_blk->features & FS_FEAT_REFLINK) {
+		remap_table = load_area(super_blk->remap_index, get_remap_blk());
+		if(remap_table == NULL)
+			return -1;
+	}
+
+	/* bring the metadata up to date with the journal, then start a fresh one */
+	if(super_blk->features & FS_FEAT_JOURNAL) {
+		int num_group = journal_replay();
+
+		if(num_group == -1)
+			return -1;
+
+		jdirty_blk = calloc((super_blk->total_data_blk + 7) / 8, 1);
+		journal_head = 0;
+		journal_ops = 0;
+
+		if(num_group > 0 && journal_checkpoint() == -1)
+			return -1;
+	}
+
+	/* block sharing is only known once the FAT is final */
+	if(remap_table != NULL)
+		build_ref_count();
+
+	if(super_blk->features & FS_FEAT_DEDUP)
+		dedup_init();
+
+	if(super_blk->features & FS_FEAT_LOG) {
+		log_fresh = calloc(super_blk->total_data_blk, 1);
+		log_pinned = calloc(super_blk->total_data_blk, 1);
+	}
+
+	count_free();
+	dir_index_build();
+	alloc.open = 0;
+
+	mount_flag = 1;
+
+	return 0;
+}
+
+int fs_umount(void)
+{
+	/* if the disk is not mounted */
+	if(!mount_flag)
+		return -1;
+
+	/* buffered data gets its blocks before the metadata is written */
+	if(flush_all() == -1)
+		return -1;
+
+	/* nothing is buffered anymore, even if the unmount fails below */
+	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		free(fd_table[i].dirty_buf);
+		fd_table[i].buffered = 0;
+		fd_table[i].dirty_buf = NULL;
+		fd_table[i].dirty_len = 0;
+		fd_table[i].dirty_cap = 0;
+	}
+
+	/* write back super block, FAT, and root directory*/
+	/* ERROR CHECKING */
+	if(jdirty_blk != NULL) {
+		/* commit first so the checkpoint never runs ahead of the journal */
+		if(journal_commit() == -1 || journal_checkpoint() == -1)
+			return -1;
+	} else {
+		if(block_write(0, super_blk) == -1)
+			return -1;
+
+		if(flush_metadata() == -1 || block_sync() == -1)
+			return -1;
+	}
+
+	/* the freed blocks are not referenced on disk anymore: release them */
+	discard_flush();
+
+	/* deallocate the memeory */
+	clean_FS();
+
+	/* close out the virtual disk */
+	if(block_disk_close() == -1)
+		return -1;
+
+	mount_flag = 0;
+
+	return 0;
+}
+
+/* make the metadata in memory durable, then discard the blocks it released */
+int sync_metadata(void) {
+	/* one group commit instead of rewriting all the metadata */
+	if(jdirty_blk != NULL)
+		return journal_commit();
+
+	if(block_write(0, super_blk) == -1 || flush_metadata() == -1 || block_sync() == -1)
+		return -1;
+
+	/* the freed blocks are not referenced on disk anymore: release them */
+	discard_flush();
+	log_unpin_all();
+
+	return 0;
+}
+
+int fs_sync(void)
+{
+	if(!mount_flag)
+		return -1;
+
+	if(flush_all() == -1)
+		return -1;
+
+	return sync_metadata();
+}
+
+int fs_info(void)
+{
+	if(!mount_flag)
+		return -1;
+
+	fprintf(stdout, "FS Info:\n");
+	fprintf(stdout, "total_blk_count=%d\n", super_blk->total_virtual_blk);
+	fprintf(stdout, "fat_blk_count=%d\n", super_blk->total_FAT_blk);
+	fprintf(stdout, "rdir_blk=%d\n", super_blk->root_dir_index);
+	fprintf(stdout, "data_blk=%d\n", super_blk->data_index);
+	fprintf(stdout, "data_blk_count=%d\n", super_blk->total_data_blk);
+	fprintf(stdout, "fat_free_ratio=%d/%d\n", get_fat_free(), super_blk->total_data_blk);
+	fprintf(stdout, "rdir_free_ratio=%d/%d\n", get_root_dir_free(), FS_FILE_MAX_COUNT);
+
+	return 0;
+}
+
+int fs_statfs(struct fs_statfs *st)
+{
+	/* ERROR CHECKING */
+	if(st == NULL || mount_flag == 0)
+		return -1;
+
+	/* SAFE TO PROCEED */
+	/* every field is at hand, nothing is scanned */
+	st->total_blk = super_blk->total_virtual_blk;
+	st->fat_blk = super_blk->total_FAT_blk;
+	st->rdir_blk = super_blk->root_dir_index;
+	st->data_blk = super_blk->data_index;
+	st->data_blk_count = super_blk->total_data_blk;
+	st->fat_free = get_fat_free();
+	st->data_free = ref_count != NULL ? alloc.data_free : get_fat_free();
+	st->rdir_free = get_root_dir_free();
+	st->open_files = alloc.open;
+	st->features = super_blk->features;
+
+	return 0;
+}
+
+int fs_create(const char *filename)
+{
+
+	/* ERROR CHECKING */
+	/* if a NULL string is passed or the disk is not mounted*/
+	if(filename == NULL || mount_flag == 0)
+		return -1;
+
+	/* there is no more empty slot for a new file */
+	if(get_root_dir_free() == 0)
+		return -1;
+
+	/* the string cannot exceed 15 characters since last character is NULL */
+	if(strlen(filename) >= FS_FILENAME_LEN)
+		return -1;
+
+	/* if the name matches with one of the file: nope! */
+	if(filename[0] == '\0' || dir_index_find(filename) != -1)
+		return -1;
+
+	/* SAFE TO PROCEED */
+	/* find empty slot in root_dir and throw all the information into it */
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if(root_dir[i].file_name[0] == '\0') {
+			create_entry(&root_dir[i], filename);
+
+			break;
+		}
+	}
+
+	return journal_op_end();
+}
+
+int fs_delete(const char *filename)
+{
+	struct root_directory* root_dir_entry;
+	int slot;
+
+	/* ERROR CHECKING */
+	if(filename == NULL || mount_flag == 0)
+		return -1;
+
+	/* find the matching name within the root_dir */
+	slot = dir_index_find(filename);
+
+	/* cannot find the file */
+	if(slot == -1)
+		return -1;
+
+	root_dir_entry = &root_dir[slot];
+
+	/* if the file is not closed */
+	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if(fd_table[i].file_dir_entry == root_dir_entry)
+			return -1;
+	}
+
+	/* SAFE TO PROCEED */
+	delete_entry(root_dir_entry);
+
+	return journal_op_end();
+}
+
+int fs_create_many(const char **filenames, int count, int *results)
+{
+	int free_slot = 0;
+	int created = 0;
+
+	/* ERROR CHECKING */
+	if(filenames == NULL || results == NULL || count < 0 || mount_flag == 0)
+		return -1;
+
+	/* SAFE TO PROCEED */
+	/* new files take the free slots in order, in one pass over the root_dir */
+
+	for(int i = 0; i < count; i++) {
+		const char* filename = filenames[i];
+
+		results[i] = -1;
+
+		if(filename == NULL || filename[0] == '\0' || strlen(filename) >= FS_FILENAME_LEN)
+			continue;
+
+		if(dir_index_find(filename) != -1)
+			continue;
+
+		while(free_slot < FS_FILE_MAX_COUNT && root_dir[free_slot].file_name[0] != '\0')
+			free_slot++;
+
+		if(free_slot == FS_FILE_MAX_COUNT)
+			continue;
+
+		create_entry(&root_dir[free_slot], filename);
+
+		results[i] = 0;
+		created++;
+	}
+
+	if(journal_op_end() == -1)
+		return -1;
+
+	return created;
+}
+
+int fs_delete_many(const char **filenames, int count, int *results)
+{
+	uint8_t open_slot[FS_FILE_MAX_COUNT] = { 0 };
+	int deleted = 0;
+
+	/* ERROR CHECKING */
+	if(filenames == NULL || results == NULL || count < 0 || mount_flag == 0)
+		return -1;
+
+	/* SAFE TO PROCEED */
+	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if(fd_table[i].file_dir_entry != NULL)
+			open_slot[fd_table[i].file_dir_entry - root_dir] = 1;
+	}
+
+	/* the freed blocks of all the files are committed and discarded together */
+	for(int i = 0; i < count; i++) {
+		int slot = filenames[i] != NULL ? dir_index_find(filenames[i]) : -1;
+
+		results[i] = -1;
+
+		if(slot == -1 || open_slot[slot])
+			continue;
+
+		delete_entry(&root_dir[slot]);
+
+		results[i] = 0;
+		deleted++;
+	}
+
+	if(journal_op_end() == -1)
+		return -1;
+
+	return deleted;
+}
+
+int fs_stat_many(const char **filenames, int count, int *sizes)
+{
+	int found = 0;
+
+	/* ERROR CHECKING */
+	if(filenames == NULL || sizes == NULL || count < 0 || mount_flag == 0)
+		return -1;
+
+	/* SAFE TO PROCEED */
+	for(int i = 0; i < count; i++) {
+		int slot = filenames[i] != NULL ? dir_index_find(filenames[i]) : -1;
+
+		sizes[i] = slot == -1 ? -1 : get_file_size(&root_dir[slot]);
+		if(slot != -1)
+			found++;
+	}
+
+	return found;
+}
+
+int fs_ls(void)
+{
+	struct fs_dirent dirent;
+	int pos = 0;
+
+	/* ERROR CHECKING */
+	if(mount_flag == 0)
+		return -1;
+
+	/* list out all the files in the root directory */
+	fprintf(stdout, "FS Ls:\n");
+	while(fs_readdir(&pos, &dirent) == 1)
+		fprintf(stdout, "file: %s, size: %zu, data_blk: %u\n", dirent.name, dirent.size, dirent.data_blk);
+
+	return 0;
+}
+
+int fs_readdir(int *pos, struct fs_dirent *dirent)
+{
+	/* ERROR CHECKING */
+	if(pos == NULL || dirent == NULL || mount_flag == 0 || *pos < 0)
+		return -1;
+
+	/* SAFE TO PROCEED */
+	/* the position is the next root_dir entry to look at */
+	for(; *pos < FS_FILE_MAX_COUNT; (*pos)++) {
+		struct root_directory* entry = &root_dir[*pos];
+
+		if(entry->file_name[0] == '\0')
+			continue;
+
+		memcpy(dirent->name, entry->file_name, FS_FILENAME_LEN);
+		dirent->size = get_file_size(entry);
+		dirent->data_blk = entry->ini_data_index;
+		dirent->pack_blk = entry->pack_index;
+		(*pos)++;
+
+		return 1;
+	}
+
+	return 0;
+}
+
+int fs_open(const char *filename)
+{
+	struct root_directory* root_dir_entry;
+	int free_fd_index = -1;
+	int slot;
+
+	/* ERROR CHECKING */
+	if(get_free_fd() == 0 || filename == NULL || mount_flag == 0)
+		return -1;
+
+	/* find the matching name within the root_dir */
+	slot = dir_index_find(filename);
+
+	/* cannot find the file */
+	if(slot == -1)
+		return -1;
+
+	root_dir_entry = &root_dir[slot];
+
+	/* SAFE TO PROCEED */
+	/* find the first empty entry of the FD table and throw the root_dir_entry in there */
+	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if(fd_table[i].file_dir_entry == NULL) {
+			free_fd_index = i;
+
+			fd_table[i].file_dir_entry = root_dir_entry;
+			alloc.open++;
+
+			break;
+		}
+	}
+
+	return free_fd_index;
 }
 
 int fs_close(int fd)
+{
+	int ret;
+
+	/* ERROR CHECKING */
+	if(fd < 0 || fd >= FS_OPEN_MAX_COUNT || fd_table[fd].file_dir_entry == NULL || mount_flag == 0)
+		return -1;
+
+	/* SAFE TO PROCEED */
+	/* the descriptor's buffered data is written even if it fails */
+	ret = fd_flush(fd);
+	free(fd_table[fd].dirty_buf);
+	fd_table[fd].buffered = 0;
+	fd_table[fd].dirty_buf = NULL;
+	fd_table[fd].dirty_cap = 0;
+
+	/* set the index of the fd_table to be null again */
+	fd_table[fd].file_dir_entry = NULL;
+	fd_table[fd].offset = 0;
+	fd_table[fd].advice = FS_ADV_NORMAL;
+	fd_table[fd].ra_next = 0;
+	fd_table[fd].ra_window = 0;
+	fd_table[fd].ra_end = 0;
+	alloc.open--;
+
+	return ret;
+}
+
+int fs_stat(int fd)
+{
+	/* ERROR CHECKING */
+	if(fd < 0 || fd >= FS_OPEN_MAX_COUNT || fd_table[fd].file_dir_entry == NULL || mount_flag == 0)
+		return -1;
+
+	return get_file_size(fd_table[fd].file_dir_entry);
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+	/* ERROR CHECKING */
+	if(fd < 0 || fd >= FS_OPEN_MAX_COUNT || fd_table[fd].file_dir_entry == NULL || mount_flag == 0)
+		return -1;
+
+	if(offset > (size_t)get_file_size(fd_table[fd].file_dir_entry))
+		return -1;
+
+	/* SAFE TO PROCEED */
+	fd_table[fd].offset = offset;
+	
+	return 0;
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+	int writable_blk;
+	int offset;
+	int write_byte;
+	int* free_fat_index_list;
+
+	/* ERROR CHECKING */
+	if(fd < 0 || fd >= FS_OPEN_MAX_COUNT || fd_table[fd].file_dir_entry == NULL || mount_flag == 0)
+		return -1;
+
+	/* buffered descriptors allocate blocks later, all at once */
+	if(fd_table[fd].buffered)
+		return buffer_write(fd, buf, count);
+
+	/* data buffered by other descriptors must not overwrite this write later */
+	if(flush_entry(fd_table[fd].file_dir_entry) == -1)
+		return -1;
+
+	/* SAFE TO PROCEED */
+	write_byte = 0;
+	offset = fd_table[fd].offset;
+
+	/* small files are packed together, a packed file that grows too much gets a block of its own */
+	if(fd_table[fd].file_dir_entry->pack_index != 0 || (fd_table[fd].file_dir_entry->ini_data_index == FAT_EOC && super_blk->features & FS_FEAT_TAILPACK)) {
+		struct root_directory* entry = fd_table[fd].file_dir_entry;
+		size_t new_file_size = offset + count > entry->file_size ? offset + count : entry->file_size;
+
+		/* no block left for the file on its own: only the bytes that still fit are written */
+		if(new_file_size > PACK_MAX_SIZE && entry->pack_index != 0 && get_fat_free() == 0) {
+			count = (size_t)offset < PACK_MAX_SIZE ? PACK_MAX_SIZE - offset : 0;
+			new_file_size = offset + count > entry->file_size ? offset + count : entry->file_size;
+		}
+
+		if(new_file_size <= PACK_MAX_SIZE) {
+			int ret;
+			uint8_t blk_buf[BLOCK_SIZE];
+			uint8_t data[PACK_MAX_SIZE];
+
+			if(count == 0)
+				return 0;
+
+			if(entry->pack_index != 0) {
+				if(read_pack_blk(entry->pack_index, blk_buf) == -1)
+					return -1;
+
+				memcpy(data, blk_buf + entry->pack_offset, entry->file_size);
+			}
+
+			memcpy(data + offset, buf, count);
+			ret = write_packed(entry, data, new_file_size);
+			if(ret <= 0)
+				return ret;
+
+			fs_lseek(fd, offset + count);
+
+			mark_dir_dirty(entry);
+			if(journal_op_end() == -1)
+				return -1;
+
+			return count;
+		}
+
+		if(entry->pack_index != 0 && unpack_file(entry) == -1)
+			return -1;
+	}
+
+	/* if the file is an empty file */
+	if(fd_table[fd].file_dir_entry->ini_data_index == FAT_EOC) {
+		/* get how many blocks can write into the FS with count */
+		if(get_fat_free() > get_count_to_blk(count)) {
+			writable_blk = get_count_to_blk(count);
+			write_byte = count;
+		} else {
+			writable_blk = get_fat_free();
+			write_byte = get_fat_free() * BLOCK_SIZE;
+		}
+
+		/* if there is no empty block or the count is zero that I can write on: return 0 byte written */
+		if(writable_blk == 0)
+			return write_byte;
+
+		/* get the list of empty slots for holding the count size */
+		free_fat_index_list = get_free_fat_indexes(writable_blk);
+
+		/* assign the write bytes into the fd_table and set to the correct offset*/
+		fd_table[fd].file_dir_entry->file_size = write_byte;
+		fd_table[fd].file_dir_entry->ini_data_index = free_fat_index_list[0];
+		fs_lseek(fd, offset + write_byte);
+
+		/* update the FAT */
+		for(int i = 0; i < writable_blk; i++) {
+			if(i != writable_blk - 1)
+				fat_set(free_fat_index_list[i], free_fat_index_list[i + 1]);
+			else
+				fat_set(free_fat_index_list[i], FAT_EOC);
+		}
+
+		/* let's write the file into the FS */
+		if(write_file_range(free_fat_index_list, writable_blk, offset, buf, write_byte) == -1)
+			return -1;
+
+		free(free_fat_index_list);
+	/* if the file is not a new file */
+	} else {
+		int ori_file_size = fd_table[fd].file_dir_entry->file_size;
+		int total_file_require_blk;
+		int single_file_require_blk;
+		int new_file_size;
+		int more_new_blk;
+		int* file_fat_indexes;
+
+		if(offset + count <= (size_t)ori_file_size) {
+			new_file_size = ori_file_size;
+		} else {
+			new_file_size = offset + count;
+		}
+
+		/* save how many blks require to write the new file, and how many blks require to write the current file */
+		total_file_require_blk = get_count_to_blk(new_file_size);
+		single_file_require_blk = get_num_file_blk(fd);
+
+		/* if the new file total block is more than what we currently have */
+		if(total_file_require_blk > single_file_require_blk) {
+			/* any more blk do we need ? */
+			more_new_blk = total_file_require_blk - single_file_require_blk;
+
+			/* if we have more free blks than what we needed */
+			if(get_fat_free() >= more_new_blk) {
+				writable_blk = more_new_blk;
+				write_byte = count;
+				fd_table[fd].file_dir_entry->file_size = new_file_size;
+			} else {
+				writable_blk = get_fat_free();
+				write_byte = (single_file_require_blk + get_fat_free()) * BLOCK_SIZE - offset;
+				fd_table[fd].file_dir_entry->file_size = (single_file_require_blk + get_fat_free()) * BLOCK_SIZE;
+			}
+
+			file_fat_indexes = get_file_fat_indexes(fd);
+			free_fat_index_list = get_free_fat_indexes(writable_blk);
+
+			/* update the FAT */
+			int current_index = file_fat_indexes[single_file_require_blk-1];
+			for(int i = 0; i < writable_blk; i++) {
+				fat_set(current_index, free_fat_index_list[i]);
+				current_index = free_fat_index_list[i];
+			}
+			fat_set(current_index, FAT_EOC);
+
+			free(file_fat_indexes);
+			free(free_fat_index_list);
+
+			/* let's write the new bytes into the FS, only the blocks they cover are touched */
+			file_fat_indexes = get_file_fat_indexes(fd);
+			if(write_file_range(file_fat_indexes, single_file_require_blk + writable_blk, offset, buf, write_byte) == -1)
+				return -1;
+
+			free(file_fat_indexes);
+
+			fs_lseek(fd, offset + write_byte);
+
+		} else {
+			if(new_file_size > ori_file_size) {
+				fd_table[fd].file_dir_entry->file_size = new_file_size;
+			}
+
+			file_fat_indexes = get_file_fat_indexes(fd);
+
+			/* modify the blocks covered by the new bytes */
+			if(write_file_range(file_fat_indexes, single_file_require_blk, offset, buf, count) == -1)
+				return -1;
+
+			free(file_fat_indexes);
+
+			write_byte = count;
+
+			fs_lseek(fd, offset + write_byte);
+		}
+	}
+
+	/* data written once is not kept in the cache at the expense of other data */
+	if(fd_table[fd].advice == FS_ADV_NOREUSE)
+		demote_file_range(fd, offset, write_byte);
+
+	mark_dir_dirty(fd_table[fd].file_dir_entry);
+	if(journal_op_end() == -1)
+		return -1;
+
+	return write_byte;
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+	void* tmp_buf;
+	int file_require_blk;
+	int offset;
+	int after_offset_size;
+	int first_blk;
+	int num_blk;
+	int ra_blk;
+	int* file_fat_indexes;
+	int read_byte;
+
+	/* ERROR CHECKING */
+	if(fd < 0 || fd >= FS_OPEN_MAX_COUNT || fd_table[fd].file_dir_entry == NULL || mount_flag == 0)
+		return -1;
+
+	/* buffered data is read back from the file */
+	if(flush_entry(fd_table[fd].file_dir_entry) == -1)
+		return -1;
+
+	if(fd_table[fd].file_dir_entry->file_size == 0)
+		return 0;
+
+	/* SAFE TO PROCEED */
+	/* a packed file is a slice of its packed block */
+	if(fd_table[fd].file_dir_entry->pack_index != 0) {
+		uint8_t blk_buf[BLOCK_SIZE];
+		struct root_directory* entry = fd_table[fd].file_dir_entry;
+
+		offset = fd_table[fd].offset;
+		read_byte = count < entry->file_size - offset ? count : entry->file_size - offset;
+
+		if(read_byte > 0) {
+			if(read_pack_blk(entry->pack_index, blk_buf) == -1)
+				return -1;
+
+			memcpy(buf, blk_buf + entry->pack_offset + offset, read_byte);
+			fs_lseek(fd, offset + read_byte);
+		}
+
+		return read_byte;
+	}
+
+	/* find out the sizes before and after the offset sizes */
+	file_require_blk = get_num_file_blk(fd);
+	offset = fd_table[fd].offset;
+	after_offset_size = fd_table[fd].file_dir_entry->file_size - offset;
+
+	/* if count is greater than what we have, then only read what we have left */
+	if(count <= (size_t)after_offset_size)
+		read_byte = count;
+	else
+		read_byte = after_offset_size;
+
+	if(read_byte == 0)
+		return 0;
+
+	/* only the blocks covering the requested bytes are read, with the readahead window in the same batch */
+	first_blk = offset / BLOCK_SIZE;
+	num_blk = (offset + read_byte - 1) / BLOCK_SIZE - first_blk + 1;
+	ra_blk = get_readahead(fd, first_blk, first_blk + num_blk);
+
+	tmp_buf = malloc(BLOCK_SIZE * (num_blk + ra_blk));
+	file_fat_indexes = get_file_fat_indexes(fd);
+
+	if(read_file_blks(file_fat_indexes, file_require_blk, first_blk, num_blk + ra_blk, tmp_buf) == -1) {
+		free(tmp_buf);
+		free(file_fat_indexes);
+		return -1;
+	}
+
+	memcpy(buf, tmp_buf + offset % BLOCK_SIZE, read_byte);
+
+	/* data read once is not kept in the cache at the expense of other data */
+	if(fd_table[fd].advice == FS_ADV_NOREUSE) {
+		for(int i = first_blk; i < first_blk + num_blk; i++)
+			cache_demote(file_fat_indexes[i]);
+	}
+
+	free(tmp_buf);
+	free(file_fat_indexes);
+
+	/* set the offset to what is not read */
+	fs_lseek(fd, offset + read_byte);
+
+	return read_byte;
+}
+
+int fs_truncate(int fd, size_t length)
+{
+	struct root_directory* entry;
+	int keep_blk;
+	int num_blk;
+	int* file_fat_indexes;
+	int unit_head = 0;
+	int unit_keep = 0;
+	void* unit_data = NULL;
+
+	/* ERROR CHECKING */
+	if(fd < 0 || fd >= FS_OPEN_MAX_COUNT || fd_table[fd].file_dir_entry == NULL || mount_flag == 0)
+		return -1;
+
+	entry = fd_table[fd].file_dir_entry;
+	if(flush_entry(entry) == -1)
+		return -1;
+
+	if(length > entry->file_size)
+		return -1;
+
+	/* SAFE TO PROCEED */
+	/* a packed file only shrinks its slice */
+	if(entry->pack_index != 0 || entry->ini_data_index == FAT_EOC) {
+		entry->file_size = length;
+		if(length == 0)
+			pack_release(entry);
+
+		mark_dir_dirty(entry);
+
+		for(int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+			if(fd_table[i].file_dir_entry == entry && fd_table[i].offset > (int)length)
+				fd_table[i].offset = length;
+		}
+
+		return journal_op_end();
+	}
+
+	keep_blk = get_count_to_blk(length);
+	num_blk = get_num_file_blk(fd);
+	file_fat_indexes = get_file_fat_indexes(fd);
+
+	/* a compressed unit cut in the middle is rewritten with only the blocks that remain */
+	if(comp_map != NULL && keep_blk < num_blk && keep_blk % COMP_UNIT_BLK != 0) {
+		unit_head = keep_blk - keep_blk % COMP_UNIT_BLK;
+		unit_keep = keep_blk - unit_head;
+
+		if(comp_map[file_fat_indexes[unit_head]] != 0) {
+			unit_data = malloc(unit_keep * BLOCK_SIZE);
+
+			if(read_file_blks(file_fat_indexes, num_blk, unit_head, unit_keep, unit_data) == -1) {
+				free(unit_data);
+				free(file_fat_indexes);
+				return -1;
+			}
+		}
+	}
+
+	/* give the tail of the chain back, preallocated blocks included */
+	for(int i = keep_blk; i < num_blk; i++)
+		release_data_blk(file_fat_indexes[i]);
+
+	if(keep_blk == 0)
+		entry->ini_data_index = FAT_EOC;
+	else
+		fat_set(file_fat_indexes[keep_blk - 1], FAT_EOC);
+
+	if(unit_data != NULL) {
+		int ret = write_file_blks(file_fat_indexes, keep_blk, unit_head, unit_keep, unit_data);
+
+		free(unit_data);
+		if(ret == -1) {
+			free(file_fat_indexes);
+			return -1;
+		}
+	}
+
+	free(file_fat_indexes);
+
+	entry->file_size = length;
+	mark_dir_dirty(entry);
+
+	/* no descriptor may point past the end of the file */
+	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if(fd_table[i].file_dir_entry == entry && fd_table[i].offset > (int)length)
+			fd_table[i].offset = length;
+	}
+
+	return journal_op_end();
+}
+
+int fs_fallocate(int fd, size_t length)
+{
+	struct root_directory* entry;
+	int num_blk = 0;
+	int more_blk;
+	int last_index = -1;
+	int run_start;
+
+	/* ERROR CHECKING */
+	if(fd < 0 || fd >= FS_OPEN_MAX_COUNT || fd_table[fd].file_dir_entry == NULL || mount_flag == 0)
+		return -1;
+
+	entry = fd_table[fd].file_dir_entry;
+	if(flush_entry(entry) == -1)
+		return -1;
+
+	/* SAFE TO PROCEED */
+	/* room is reserved in whole blocks */
+	if(entry->pack_index != 0 && length > entry->file_size && unpack_file(entry) == -1)
+		return -1;
+
+	if(entry->ini_data_index != FAT_EOC) {
+		int* file_fat_indexes = get_file_fat_indexes(fd);
+
+		num_blk = get_num_file_blk(fd);
+		last_index = file_fat_indexes[num_blk - 1];
+		free(file_fat_indexes);
+	}
+
+	more_blk = get_count_to_blk(length) - num_blk;
+	if(more_blk <= 0)
+		return 0;
+
+	/* one run of free blocks, right after the file's last block if possible */
+	run_start = find_free_run(more_blk, last_index + 1);
+	if(run_start == -1)
+		return -1;
+
+	for(int i = run_start; i < run_start + more_blk; i++) {
+		claim_data_blk(i);
+		fat_set(i, i == run_start + more_blk - 1 ? FAT_EOC : i + 1);
+	}
+
+	if(last_index == -1)
+		entry->ini_data_index = run_start;
+	else
+		fat_set(last_index, run_start);
+
+	mark_dir_dirty(entry);
+
+	return journal_op_end();
+}
+
+int fs_buffer(int fd, int enable)
 {
 	/* ERROR CHECKING */
-	if(fd < 0 || fd > FS_OPEN_MAX_COUNT || fd_table[fd].file_dir_entry == NULL || mount_flag == 0)
+	if(fd < 0 || fd >= FS_OPEN_MAX_COUNT || fd_table[fd].file_dir_entry == NULL || mount_flag == 0)
 		return -1;
 
 	/* SAFE TO PROCEED */
-	/* set the index of the fd_table to be null again */
-	fd_table[fd].file_dir_entry = NULL;
-	fd_table[fd].offset = 0;
+	if(!enable && fd_flush(fd) == -1)
+		return -1;
+
+	fd_table[fd].buffered = enable ? 1 : 0;
 
 	return 0;
 }
 
-int fs_stat(int fd)
+int fs_advise(int fd, size_t offset, size_t len, int hint)
 {
+	struct root_directory* entry;
+	int num_chain;
+	int first_blk;
+	int num_blk;
+	int* file_fat_indexes;
+	void* tmp_buf;
+	int ret = 0;
+
 	/* ERROR CHECKING */
-	if(fd < 0 || fd > FS_OPEN_MAX_COUNT || fd_table[fd].file_dir_entry == NULL || mount_flag == 0)
+	if(fd < 0 || fd >= FS_OPEN_MAX_COUNT || fd_table[fd].file_dir_entry == NULL || mount_flag == 0)
+		return -1;
+
+	if(hint < FS_ADV_NORMAL || hint > FS_ADV_NOREUSE)
+		return -1;
+
+	/* SAFE TO PROCEED */
+	/* access patterns hold for the whole file, the readahead starts over */
+	if(hint != FS_ADV_WILLNEED && hint != FS_ADV_DONTNEED) {
+		fd_table[fd].advice = hint;
+		fd_table[fd].ra_window = 0;
+		fd_table[fd].ra_end = 0;
+		return 0;
+	}
+
+	entry = fd_table[fd].file_dir_entry;
+	if(flush_entry(entry) == -1)
 		return -1;
 
-	return fd_table[fd].file_dir_entry->file_size;
+	/* a packed block is shared with other files, it is left as it is */
+	if(entry->pack_index != 0 || offset >= entry->file_size)
+		return 0;
+
+	if(len == 0 || len > entry->file_size - offset)
+		len = entry->file_size - offset;
+
+	num_chain = get_num_file_blk(fd);
+	first_blk = offset / BLOCK_SIZE;
+	num_blk = (offset + len - 1) / BLOCK_SIZE - first_blk + 1;
+	file_fat_indexes = get_file_fat_indexes(fd);
+
+	if(hint == FS_ADV_DONTNEED) {
+		for(int i = first_blk; i < first_blk + num_blk; i++)
+			cache_invalidate(file_fat_indexes[i]);
+	} else {
+		/* loading more than the cache holds would evict the start of the range */
+		if(num_blk > CACHE_BLOCK_COUNT)
+			num_blk = CACHE_BLOCK_COUNT;
+
+		tmp_buf = malloc(BLOCK_SIZE * num_blk);
+		ret = read_file_blks(file_fat_indexes, num_chain, first_blk, num_blk, tmp_buf);
+		free(tmp_buf);
+	}
+
+	free(file_fat_indexes);
+
+	return ret;
 }
 
-int fs_lseek(int fd, size_t offset)
+void *fs_map(int fd, size_t *len)
+{
+	int num_blk;
+	int* file_fat_indexes;
+	size_t* blocks;
+	void* addr;
+
+	/* ERROR CHECKING */
+	if(fd < 0 || fd >= FS_OPEN_MAX_COUNT || fd_table[fd].file_dir_entry == NULL || mount_flag == 0 || len == NULL)
+		return NULL;
+
+	if(flush_entry(fd_table[fd].file_dir_entry) == -1)
+		return NULL;
+
+	if(fd_table[fd].file_dir_entry->file_size == 0 || fd_table[fd].file_dir_entry->pack_index != 0)
+		return NULL;
+
+	/* SAFE TO PROCEED */
+	num_blk = get_count_to_blk(fd_table[fd].file_dir_entry->file_size);
+	file_fat_indexes = get_file_fat_indexes(fd);
+
+	/* packed units don't hold the file's bytes as they are */
+	for(int i = 0; comp_map != NULL && i < num_blk; i += COMP_UNIT_BLK) {
+		if(comp_map[file_fat_indexes[i]] != 0) {
+			free(file_fat_indexes);
+			return NULL;
+		}
+	}
+
+	blocks = malloc(sizeof(size_t) * num_blk);
+	for(int i = 0; i < num_blk; i++)
+		blocks[i] = super_blk->data_index + get_phys_blk(file_fat_indexes[i]);
+
+	/* a contiguous file is a single mapping, a fragmented one is stitched together */
+	addr = block_map(blocks, num_blk);
+
+	free(blocks);
+	free(file_fat_indexes);
+
+	if(addr != NULL)
+		*len = fd_table[fd].file_dir_entry->file_size;
+
+	return addr;
+}
+
+int fs_unmap(void *addr, size_t len)
+{
+	if(addr == NULL || len == 0)
+		return -1;
+
+	return block_unmap(addr, get_count_to_blk(len));
+}
+
+int fs_clone(const char *src, const char *dst)
 {
+	struct root_directory* src_entry = NULL;
+	struct root_directory* dst_entry = NULL;
+	int num_blk = 0;
+	int src_index;
+	int prev_index = -1;
+	int free_index = 1;
+
 	/* ERROR CHECKING */
-	if(fd < 0 || fd > FS_OPEN_MAX_COUNT || fd_table[fd].file_dir_entry == NULL || mount_flag == 0)
+	if(src == NULL || dst == NULL || mount_flag == 0 || ref_count == NULL)
+		return -1;
+
+	if(strlen(dst) >= FS_FILENAME_LEN)
+		return -1;
+
+	if(dst[0] == '\0' || dir_index_find(dst) != -1 || dir_index_find(src) == -1)
+		return -1;
+
+	src_entry = &root_dir[dir_index_find(src)];
+	for(int i = 0; i < FS_FILE_MAX_COUNT && dst_entry == NULL; i++) {
+		if(root_dir[i].file_name[0] == '\0')
+			dst_entry = &root_dir[i];
+	}
+
+	if(dst_entry == NULL)
+		return -1;
+
+	if(flush_entry(src_entry) == -1)
 		return -1;
 
-	if(offset > fd_table[fd].file_dir_entry->file_size)
+	/* every block of the clone needs a FAT entry, not a data block */
+	for(src_index = src_entry->ini_data_index; src_index != FAT_EOC; src_index = file_alloc_table[src_index])
+		num_blk++;
+
+	if(num_blk > get_fat_free())
 		return -1;
 
 	/* SAFE TO PROCEED */
-	fd_table[fd].offset = offset;
-	
-	return 0;
+	/* packed files are small enough to be copied */
+	if(src_entry->pack_index != 0) {
+		uint8_t blk_buf[BLOCK_SIZE];
+
+		if(read_pack_blk(src_entry->pack_index, blk_buf) == -1)
+			return -1;
+
+		dst_entry->ini_data_index = FAT_EOC;
+		if(write_packed(dst_entry, blk_buf + src_entry->pack_offset, src_entry->file_size) != 1)
+			return -1;
+
+		set_file_name(dst_entry, dst);
+		mark_dir_dirty(dst_entry);
+
+		return journal_op_end();
+	}
+
+	set_file_name(dst_entry, dst);
+	dst_entry->file_size = src_entry->file_size;
+	dst_entry->ini_data_index = FAT_EOC;
+
+	/* build a new chain whose entries point at the data blocks of the source */
+	for(src_index = src_entry->ini_data_index; src_index != FAT_EOC; src_index = file_alloc_table[src_index]) {
+		while(file_alloc_table[free_index] != 0)
+			free_index++;
+
+		set_phys_blk(free_index, get_phys_blk(src_index));
+		fat_set(free_index, FAT_EOC);
+		if(crc_table != NULL)
+			crc_table[free_index] = crc_table[src_index];
+
+		if(prev_index == -1)
+			dst_entry->ini_data_index = free_index;
+		else
+			fat_set(prev_index, free_index);
+
+		prev_index = free_index;
+	}
+
+	mark_dir_dirty(dst_entry);
+
+	return journal_op_end();
 }
 
-int fs_write(int fd, void *buf, size_t count)
+int fs_extents(int fd)
 {
-	int writable_blk;
-	int offset;
-	int write_byte;
-	int* free_fat_index_list;
+	int num_blk;
+	int* chain;
+	int result;
 
 	/* ERROR CHECKING */
-	if(fd < 0 || fd > FS_OPEN_MAX_COUNT || fd_table[fd].file_dir_entry == NULL || mount_flag == 0)
+	if(fd < 0 || fd >= FS_OPEN_MAX_COUNT || fd_table[fd].file_dir_entry == NULL || mount_flag == 0)
 		return -1;
 
-	/* SAFE TO PROCEED */
-	write_byte = 0;
-	offset = fd_table[fd].offset;
+	if(flush_entry(fd_table[fd].file_dir_entry) == -1)
+		return -1;
 
-	/* if the file is an empty file */
-	if(fd_table[fd].file_dir_entry->ini_data_index == FAT_EOC) {
-		/* get how many blocks can write into the FS with count */
-		if(get_fat_free() > get_count_to_blk(count)) {
-			writable_blk = get_count_to_blk(count);
-			write_byte = count;
-		} else {
-			writable_blk = get_fat_free();
-			write_byte = get_fat_free() * BLOCK_SIZE;
-		}
+	if(fd_table[fd].file_dir_entry->pack_index != 0)
+		return 1;
 
-		/* if there is no empty block or the count is zero that I can write on: return 0 byte written */
-		if(writable_blk == 0)
-			return write_byte;
+	chain = get_entry_fat_indexes(fd_table[fd].file_dir_entry, &num_blk);
+	result = get_num_extent(chain, num_blk);
+	free(chain);
 
-		/* get the list of empty slots for holding the count size */
-		free_fat_index_list = get_free_fat_indexes(writable_blk);
+	return result;
+}
 
-		/* assign the write bytes into the fd_table and set to the correct offset*/
-		fd_table[fd].file_dir_entry->file_size = write_byte;
-		fd_table[fd].file_dir_entry->ini_data_index = free_fat_index_list[0];
-		fs_lseek(fd, offset + write_byte);
+int fs_defrag(int budget)
+{
+	int moved = 0;
+	int* old_index;
+	int ret = 0;
 
-		/* update the FAT */
-		for(int i = 0; i < writable_blk; i++) {
-			if(i != writable_blk - 1)
-				file_alloc_table[free_fat_index_list[i]] = free_fat_index_list[i + 1];
-			else
-				file_alloc_table[free_fat_index_list[i]] = FAT_EOC;
-		}
+	/* ERROR CHECKING */
+	if(budget <= 0 || mount_flag == 0)
+		return -1;
 
-		/* let's write the file into the FS */
-		for(int i = 0; i < writable_blk; i++) {
-			if(block_write(super_blk->data_index + free_fat_index_list[i], buf + (BLOCK_SIZE * i)) == -1)
-				return -1;
-		}
-	/* if the file is not a new file */
-	} else {
-		int ori_file_size = fd_table[fd].file_dir_entry->file_size;
-		int total_file_require_blk;
-		int single_file_require_blk;
-		int new_file_size;
-		int more_new_blk;
-		int* file_fat_indexes;
-		void* tmp_buf = NULL;
+	if(flush_all() == -1)
+		return -1;
 
-		if(offset + count <= (size_t)ori_file_size) {
-			new_file_size = ori_file_size;
-		} else {
-			new_file_size = offset + count;
+	/* each move leaves a distinct FAT entry taken until the end of the call */
+	if(budget > super_blk->total_data_blk)
+		budget = super_blk->total_data_blk;
+
+	old_index = malloc(sizeof(int) * budget);
+	if(old_index == NULL)
+		return -1;
+
+	/* SAFE TO PROCEED */
+	/* resume with the file where the previous call stopped */
+	for(int n = 0; n < FS_FILE_MAX_COUNT && moved < budget; n++) {
+		struct root_directory* entry = &root_dir[defrag_slot];
+
+		if(entry->file_name[0] != '\0' && entry->ini_data_index != FAT_EOC) {
+			int file_moved;
+
+			/* the blocks moved before a failure are in the chain all the same */
+			ret = defrag_file(entry, budget - moved, old_index + moved, &file_moved);
+			moved += file_moved;
+			if(ret == -1)
+				break;
+
+			/* the budget ran out in the middle of this file */
+			if(moved == budget)
+				break;
 		}
 
-		/* save how many blks require to write the new file, and how many blks require to write the current file */
-		total_file_require_blk = get_count_to_blk(new_file_size);
-		single_file_require_blk = get_num_file_blk(fd);
+		defrag_slot = (defrag_slot + 1) % FS_FILE_MAX_COUNT;
+	}
 
-		/* if the new file total block is more than what we currently have */
-		if(total_file_require_blk > single_file_require_blk) {
-			/* any more blk do we need ? */
-			more_new_blk = total_file_require_blk - single_file_require_blk;
+	/*
+	 * the chains on disk still go through the old entries: they can only be
+	 * released, and later reused or discarded, once the new chains are durable;
+	 * otherwise they stay taken, which fsck reports as leaked
+	 */
+	if((moved > 0 && sync_metadata() == -1) || journal_op_end() == -1) {
+		free(old_index);
+		return -1;
+	}
 
-			/* if we have more free blks than what we needed */
-			if(get_fat_free() >= more_new_blk) {
-				writable_blk = more_new_blk;
-				write_byte = count;
-				fd_table[fd].file_dir_entry->file_size = new_file_size;
-			} else {
-				writable_blk = get_fat_free();
-				write_byte = (single_file_require_blk + get_fat_free()) * BLOCK_SIZE - offset;
-				fd_table[fd].file_dir_entry->file_size = (single_file_require_blk + get_fat_free()) * BLOCK_SIZE;
-			}
+	for(int i = 0; i < moved; i++)
+		release_data_blk(old_index[i]);
 
-			tmp_buf = malloc(total_file_require_blk * BLOCK_SIZE);
-			memset(tmp_buf, '\0', total_file_require_blk * BLOCK_SIZE);
+	free(old_index);
 
-			file_fat_indexes = get_file_fat_indexes(fd);
-			free_fat_index_list = get_free_fat_indexes(writable_blk);
+	if(ret == -1)
+		return -1;
 
-			/* read the current file into a tmp_buf */
-			for(int i = 0; i < single_file_require_blk; i++) {
-				if(block_read(super_blk->data_index + file_fat_indexes[i], tmp_buf + (BLOCK_SIZE * i)) == -1)
-					return -1;
-			}
+	return moved;
+}
 
-			/* copy those info into tmp_buf */
-			memcpy(tmp_buf + offset, buf, count);
+int fs_clean(int budget)
+{
+	int seg_used[FS_MAX_BLOCKS / LOG_SEG_BLK + 1] = { 0 };
+	int num_seg;
+	int victim = -1;
+	int moved = 0;
+	int first;
+	int end;
 
-			/* update the FAT */
-			int current_index = file_fat_indexes[single_file_require_blk-1];
-			for(int i = 0; i < writable_blk; i++) {
-				file_alloc_table[current_index] = free_fat_index_list[i];
-				current_index = free_fat_index_list[i];
-			}
-			file_alloc_table[current_index] = FAT_EOC;
+	/* ERROR CHECKING */
+	if(budget <= 0 || mount_flag == 0 || log_fresh == NULL)
+		return -1;
 
-			/* let's write the file into the FS */
-			int current_FAT_index = fd_table[fd].file_dir_entry->ini_data_index;
-			for(int i = 0; i < single_file_require_blk + writable_blk; i++) {
-				if(block_write(super_blk->data_index + current_FAT_index, tmp_buf + (BLOCK_SIZE * i)) == -1)
-					return -1;
+	/* SAFE TO PROCEED */
+	/* the sparsest segment, besides empty ones and the one being written */
+	num_seg = (super_blk->total_data_blk + LOG_SEG_BLK - 1) / LOG_SEG_BLK;
+	for(int i = 1; i < super_blk->total_data_blk; i++) {
+		if(ref_count[i] != 0)
+			seg_used[i / LOG_SEG_BLK]++;
+	}
 
-				current_FAT_index = file_alloc_table[current_FAT_index];
-			}
+	for(int seg = 0; seg < num_seg; seg++) {
+		if(seg_used[seg] == 0 || seg_used[seg] > LOG_CLEAN_MAX_USED || seg == super_blk->log_head / LOG_SEG_BLK)
+			continue;
 
-			fs_lseek(fd, offset + write_byte);
+		if(victim == -1 || seg_used[seg] < seg_used[victim])
+			victim = seg;
+	}
 
-		} else {
-			if(new_file_size > ori_file_size) {
-				fd_table[fd].file_dir_entry->file_size = new_file_size;
-			}
+	if(victim == -1)
+		return 0;
 
-			tmp_buf = malloc(single_file_require_blk * BLOCK_SIZE);
-			memset(tmp_buf, '\0', single_file_require_blk * BLOCK_SIZE);
+	first = victim * LOG_SEG_BLK;
+	end = first + LOG_SEG_BLK < super_blk->total_data_blk ? first + LOG_SEG_BLK : super_blk->total_data_blk;
+
+	/* move the blocks in use one batch at a time, all their FAT entries follow */
+	while(moved < budget) {
+		size_t old_blocks[LOG_SEG_BLK];
+		size_t new_blocks[LOG_SEG_BLK];
+		int new_blk[LOG_SEG_BLK];
+		int old_blk[LOG_SEG_BLK];
+		uint8_t* buf;
+		int num = 0;
+
+		for(int blk = first; blk < end && moved + num < budget; blk++) {
+			if(blk == 0 || ref_count[blk] == 0)
+				continue;
+
+			new_blk[num] = log_alloc(victim);
+			if(new_blk[num] == -1)
+				break;
+
+			/* taken for now, the count moves along with the block below */
+			ref_count[new_blk[num]] = 1;
+			discard_cancel_phys(new_blk[num]);
+			old_blk[num] = blk;
+			old_blocks[num] = super_blk->data_index + blk;
+			new_blocks[num] = super_blk->data_index + new_blk[num];
+			num++;
+		}
 
-			file_fat_indexes = get_file_fat_indexes(fd);
+		if(num == 0)
+			break;
 
-			/* read the old file into a tmp_buf */
-			for(int i = 0; i < single_file_require_blk; i++) {
-				if(block_read(super_blk->data_index + file_fat_indexes[i], tmp_buf + (BLOCK_SIZE * i)) == -1)
-					return -1;
-			}
+		buf = malloc(BLOCK_SIZE * num);
+		if(block_read_many(old_blocks, num, buf) == -1 || block_write_many(new_blocks, num, buf) == -1) {
+			free(buf);
+			return -1;
+		}
+		free(buf);
 
-			/* modify the file */
-			memcpy(tmp_buf + offset, buf, count);
+		for(int i = 1; i < super_blk->total_data_blk; i++) {
+			int blk = get_phys_blk(i);
 
-			/* write the new file into the data blocks */
-			for(int i = 0; i < single_file_require_blk; i++) {
-				if(block_write(super_blk->data_index + file_fat_indexes[i], tmp_buf + (BLOCK_SIZE * i)) == -1)
-					return -1;
+			if(file_alloc_table[i] == 0 || blk < first || blk >= end)
+				continue;
+
+			for(int j = 0; j < num; j++) {
+				if(old_blk[j] == blk) {
+					remap_table[i] = new_blk[j] == i ? 0 : new_blk[j];
+					mark_blk_dirty(i);
+					break;
+				}
 			}
+		}
 
-			write_byte = count;
+		for(int j = 0; j < num; j++) {
+			ref_count[new_blk[j]] = ref_count[old_blk[j]];
+			ref_count[old_blk[j]] = 0;
 
-			fs_lseek(fd, offset + write_byte);
+			if(dedup_index != NULL && dedup_index[old_blk[j]].indexed) {
+				dedup_insert(new_blk[j], dedup_index[old_blk[j]].hash);
+				dedup_forget(old_blk[j]);
+			}
+
+			discard_phys_blk(old_blk[j]);
+			log_pin(old_blk[j]);
 		}
+
+		moved += num;
 	}
 
-	return write_byte;
+	if(journal_op_end() == -1)
+		return -1;
+
+	return moved;
 }
 
-int fs_read(int fd, void *buf, size_t count)
+int fs_feature_enable(int feature)
 {
-	void* tmp_buf;
-	int file_require_blk;
-	int offset;
-	int after_offset_size;
-	int current_FAT_index;
-	int read_byte;
+	int area_index;
 
 	/* ERROR CHECKING */
-	if(fd < 0 || fd > FS_OPEN_MAX_COUNT || fd_table[fd].file_dir_entry == NULL || mount_flag == 0)
+	if(mount_flag == 0 || (feature & ~FS_FEAT_ALL) != 0)
 		return -1;
-	
-	if(fd_table[fd].file_dir_entry->file_size == 0)
+
+	/* already there */
+	if((super_blk->features & feature) == (uint32_t)feature)
 		return 0;
 
-	/* SAFE TO PROCEED */
-	/* find out the sizes before and after the offset sizes */
-	file_require_blk = get_num_file_blk(fd);
-	offset = fd_table[fd].offset;
-	after_offset_size = fd_table[fd].file_dir_entry->file_size - offset;
+	/* the superblock changes: the journal must be empty beforehand */
+	if(jdirty_blk != NULL && journal_commit() == -1)
+		return -1;
 
-	/* allocate enough for the file first */
-	tmp_buf = malloc(BLOCK_SIZE * file_require_blk);
-	memset(tmp_buf, '\0', BLOCK_SIZE * file_require_blk);
+	/* compressed units can't be shared block by block */
+	if(((feature | super_blk->features) & (FS_FEAT_COMPRESS | FS_FEAT_REFLINK)) == (FS_FEAT_COMPRESS | FS_FEAT_REFLINK))
+		return -1;
+
+	/* duplicated blocks are shared like the blocks of clones, and blocks move through the remap table */
+	if((feature == FS_FEAT_DEDUP || feature == FS_FEAT_LOG) && !(super_blk->features & FS_FEAT_REFLINK))
+		return -1;
 
-	/* let's read the block into tmp_buf */
-	current_FAT_index = fd_table[fd].file_dir_entry->ini_data_index;
-	for(int i = 0; i < file_require_blk; i++) {
-		if(block_read(super_blk->data_index + current_FAT_index, tmp_buf + (BLOCK_SIZE * i)) == -1)
+	switch(feature) {
+	case FS_FEAT_COMPRESS:
+		/* one byte per data block, every unit starts raw */
+		area_index = reserve_tail_blk(get_cmap_blk());
+		if(area_index == -1)
 			return -1;
 
-		current_FAT_index = file_alloc_table[current_FAT_index];
-	}
+		super_blk->cmap_index = area_index;
+		comp_map = calloc(get_cmap_blk() * BLOCK_SIZE, 1);
+		break;
+	case FS_FEAT_CRC32C:
+		/* blocks already written have no checksum until they are rewritten */
+		area_index = reserve_tail_blk(get_crc_blk());
+		if(area_index == -1)
+			return -1;
 
-	if(count <= (size_t)after_offset_size) {
-		/* if count is less than or equal to what we have left, just copy them to buf */
-		tmp_buf += offset;
-		memcpy(buf, tmp_buf, count);
-		read_byte = count;
-		/* set the offset to what is not read */
-		fs_lseek(fd, offset + read_byte);
-	} else {
-		/* if count is greater than what we have, then put what we have left in buf */
-		tmp_buf += offset;
-		memcpy(buf, tmp_buf, after_offset_size);
-		read_byte = after_offset_size;
-		/* set the offset to what is not read */
-		fs_lseek(fd, offset + read_byte);
+		super_blk->crc_index = area_index;
+		crc_table = calloc(get_crc_blk() * BLOCK_SIZE, 1);
+		break;
+	case FS_FEAT_JOURNAL:
+		/* room for two of the largest possible groups */
+		area_index = reserve_tail_blk(2 * get_journal_group_blk());
+		if(area_index == -1)
+			return -1;
+
+		super_blk->journal_index = area_index;
+		super_blk->journal_blk = 2 * get_journal_group_blk();
+		journal_next_seq = super_blk->journal_seq + 1;
+		jdirty_blk = calloc((super_blk->total_data_blk + 7) / 8, 1);
+		break;
+	case FS_FEAT_TAILPACK:
+		/* nothing on disk, small files are packed from now on */
+		break;
+	case FS_FEAT_DEDUP:
+		/* nothing on disk, the index is filled as blocks are read and written */
+		dedup_init();
+		break;
+	case FS_FEAT_LOG:
+		/* the log starts after the blocks in use */
+		super_blk->log_head = 1;
+		for(int i = 1; i < super_blk->total_data_blk; i++) {
+			if(ref_count[i] != 0)
+				super_blk->log_head = i + 1;
+		}
+
+		log_fresh = calloc(super_blk->total_data_blk, 1);
+		log_pinned = calloc(super_blk->total_data_blk, 1);
+		break;
+	case FS_FEAT_REFLINK:
+		/* two bytes per data block, every FAT entry starts with its own block */
+		area_index = reserve_tail_blk(get_remap_blk());
+		if(area_index == -1)
+			return -1;
+
+		super_blk->remap_index = area_index;
+		remap_table = calloc(get_remap_blk() * BLOCK_SIZE, 1);
+		build_ref_count();
+		break;
+	default:
+		return -1;
 	}
 
-	return read_byte;
+	super_blk->features |= feature;
+
+	/* feature areas take data blocks away */
+	count_free();
+
+	if(jdirty_blk != NULL)
+		return journal_checkpoint();
+
+	return 0;
 }
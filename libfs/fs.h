@@ -2,6 +2,7 @@
 #define _FS_H
 
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h>
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
@@ -9,9 +10,78 @@
 /** Maximum number of files in the root directory */
 #define FS_FILE_MAX_COUNT 128
 
+/** Maximum number of blocks of a virtual disk */
+#define FS_MAX_BLOCKS 0xFFFF
+
 /** Maximum number of open files */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Optional features: transparent compression of file data */
+#define FS_FEAT_COMPRESS 0x1
+/** Optional features: CRC32C checksum of every data block */
+#define FS_FEAT_CRC32C 0x2
+/** Optional features: write-ahead journal of metadata updates */
+#define FS_FEAT_JOURNAL 0x4
+/** Optional features: data blocks shared between cloned files */
+#define FS_FEAT_REFLINK 0x8
+/** Optional features: small files packed together in shared blocks */
+#define FS_FEAT_TAILPACK 0x10
+/** Optional features: data blocks with the same content stored once */
+#define FS_FEAT_DEDUP 0x20
+/** Optional features: data written sequentially at a moving log head */
+#define FS_FEAT_LOG 0x40
+
+/** Access hints: no particular pattern, readahead adapts to the reads */
+#define FS_ADV_NORMAL 0
+/** Access hints: the file is read in order, read ahead as much as possible */
+#define FS_ADV_SEQUENTIAL 1
+/** Access hints: the file is read at random, never read ahead */
+#define FS_ADV_RANDOM 2
+/** Access hints: the range will be read soon, load it in the cache now */
+#define FS_ADV_WILLNEED 3
+/** Access hints: the range will not be read soon, drop it from the cache */
+#define FS_ADV_DONTNEED 4
+/** Access hints: the data is read or written once, evict it first */
+#define FS_ADV_NOREUSE 5
+
+/** File system statistics, see fs_statfs() */
+struct fs_statfs {
+	size_t total_blk;		/* Blocks of the virtual disk */
+	size_t fat_blk;			/* Blocks of the FAT */
+	size_t rdir_blk;		/* Index of the root directory block */
+	size_t data_blk;		/* Index of the first data block */
+	size_t data_blk_count;		/* Number of data blocks */
+	size_t fat_free;		/* Free FAT entries */
+	size_t data_free;		/* Data blocks used by no file */
+	size_t rdir_free;		/* Free root directory entries */
+	size_t open_files;		/* Open file descriptors */
+	uint32_t features;		/* Enabled features (FS_FEAT_*) */
+};
+
+/** File of the root directory, see fs_readdir() */
+struct fs_dirent {
+	char name[FS_FILENAME_LEN];	/* File name */
+	size_t size;			/* File size in bytes */
+	uint16_t data_blk;		/* First FAT entry of the file, 0xFFFF if none */
+	uint16_t pack_blk;		/* Packed block holding the file, 0 if none */
+};
+
+/**
+ * fs_format - Create a file system
+ * @diskname: Name of the virtual disk file
+ * @data_blk_count: Number of data blocks of the file system
+ *
+ * Create virtual disk file @diskname with an empty file system of
+ * @data_blk_count data blocks, sized for its superblock, FAT and root
+ * directory. The image is sparse: only the metadata blocks are written, in a
+ * single request.
+ *
+ * Return: -1 if a file system is currently mounted, if @data_blk_count is too
+ * small or too large for the disk to fit in %FS_MAX_BLOCKS blocks, or if the
+ * virtual disk file cannot be created or written. 0 otherwise.
+ */
+int fs_format(const char *diskname, size_t data_blk_count);
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -36,6 +106,19 @@ int fs_mount(const char *diskname);
  */
 int fs_umount(void);
 
+/**
+ * fs_sync - Make changes durable
+ *
+ * Make sure that all the changes made to the currently mounted file system so
+ * far would survive a crash. With %FS_FEAT_JOURNAL, this commits the metadata
+ * changes to the journal as a single group. Otherwise, all the metadata is
+ * written back to the disk.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if the changes cannot
+ * be written. 0 otherwise.
+ */
+int fs_sync(void);
+
 /**
  * fs_info - Display information about file system
  *
@@ -45,6 +128,23 @@ int fs_umount(void);
  */
 int fs_info(void);
 
+/**
+ * fs_statfs - Get file system statistics
+ * @st: Structure to fill
+ *
+ * Fill @st with the layout of the currently mounted file system and the number
+ * of free FAT entries, data blocks and root directory entries. The counts are
+ * kept up to date as the file system changes, so this takes constant time and
+ * can be called as often as needed. Without %FS_FEAT_REFLINK, @st->data_free
+ * equals @st->fat_free. With %FS_FEAT_LOG, a data block the log moved a file
+ * block away from is only counted once the move is on disk, after the next
+ * journal commit or fs_sync().
+ *
+ * Return: -1 if no underlying virtual disk was opened or if @st is NULL. 0
+ * otherwise.
+ */
+int fs_statfs(struct fs_statfs *st);
+
 /**
  * fs_create - Create a new file
  * @filename: File name
@@ -72,6 +172,48 @@ int fs_create(const char *filename);
  */
 int fs_delete(const char *filename);
 
+/**
+ * fs_create_many - Create several files
+ * @filenames: Array of @count file names
+ * @count: Number of files to create
+ * @results: Array receiving 0 or -1 for each file, whether it was created
+ *
+ * Create the files named in @filenames as fs_create() would, with a single
+ * pass over the root directory and a single journal operation for all of them.
+ * A file that cannot be created does not prevent the others from being
+ * created.
+ *
+ * Return: -1 if no underlying virtual disk was opened or if an argument is
+ * invalid. Otherwise return the number of files created.
+ */
+int fs_create_many(const char **filenames, int count, int *results);
+
+/**
+ * fs_delete_many - Delete several files
+ * @filenames: Array of @count file names
+ * @count: Number of files to delete
+ * @results: Array receiving 0 or -1 for each file, whether it was deleted
+ *
+ * Delete the files named in @filenames as fs_delete() would, with a single
+ * pass over the root directory. The blocks freed by all the files are
+ * committed and discarded together.
+ *
+ * Return: -1 if no underlying virtual disk was opened or if an argument is
+ * invalid. Otherwise return the number of files deleted.
+ */
+int fs_delete_many(const char **filenames, int count, int *results);
+
+/**
+ * fs_stat_many - Get the size of several files
+ * @filenames: Array of @count file names
+ * @count: Number of files
+ * @sizes: Array receiving the size of each file, -1 if it does not exist
+ *
+ * Return: -1 if no underlying virtual disk was opened or if an argument is
+ * invalid. Otherwise return the number of files found.
+ */
+int fs_stat_many(const char **filenames, int count, int *sizes);
+
 /**
  * fs_ls - List files on file system
  *
@@ -81,6 +223,20 @@ int fs_delete(const char *filename);
  */
 int fs_ls(void);
 
+/**
+ * fs_readdir - Iterate over the files of the root directory
+ * @pos: Position of the iteration, set to 0 to start from the first file
+ * @dirent: Structure to fill with the next file
+ *
+ * Fill @dirent with the file found at or after position @pos in the root
+ * directory, and move @pos past it. Files created or deleted during the
+ * iteration may or may not be seen.
+ *
+ * Return: -1 if no underlying virtual disk was opened or if @pos or @dirent is
+ * invalid. 0 if there are no more files. 1 otherwise.
+ */
+int fs_readdir(int *pos, struct fs_dirent *dirent);
+
 /**
  * fs_open - Open a file
  * @filename: File name
@@ -103,10 +259,10 @@ int fs_open(const char *filename);
  * fs_close - Close a file
  * @fd: File descriptor
  *
- * Close file descriptor @fd.
+ * Close file descriptor @fd, writing the data it buffered (see fs_buffer()).
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). 0 otherwise.
+ * open), or if buffered data cannot be written. 0 otherwise.
  */
 int fs_close(int fd);
 
@@ -177,4 +333,229 @@ int fs_write(int fd, void *buf, size_t count);
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_truncate - Shrink a file
+ * @fd: File descriptor
+ * @length: New size of the file
+ *
+ * Cut the file referenced by file descriptor @fd down to @length bytes. The
+ * data blocks past the new end of the file, including blocks reserved with
+ * fs_fallocate(), are freed. File offsets past the new end of the file are
+ * moved back to it.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if @length is larger than the current file size. 0 otherwise.
+ */
+int fs_truncate(int fd, size_t length);
+
+/**
+ * fs_fallocate - Reserve space for a file
+ * @fd: File descriptor
+ * @length: Number of bytes to reserve room for
+ *
+ * Make sure the file referenced by file descriptor @fd has data blocks for at
+ * least @length bytes, without changing its size. The missing blocks are taken
+ * as one contiguous run, right after the file's last block when possible, so
+ * that later writes up to @length need no allocation.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if there is no run of free blocks large enough. 0 otherwise.
+ */
+int fs_fallocate(int fd, size_t length);
+
+/**
+ * fs_buffer - Turn buffered writes on or off
+ * @fd: File descriptor
+ * @enable: Non-zero to buffer the writes, zero to write them immediately
+ *
+ * With buffered writes, fs_write() on file descriptor @fd only copies the data
+ * in memory. Consecutive or overlapping writes are gathered, and the data
+ * blocks are only allocated and written when the data is flushed: by
+ * fs_close(), fs_sync() or fs_umount(), when turning buffered writes off, when
+ * another operation needs the file's blocks (reading it for instance), or when
+ * a write does not follow the buffered data. Knowing the final size, the flush
+ * reserves the new blocks as one contiguous run when possible.
+ *
+ * Running out of space is only noticed by the flush, whose caller then returns
+ * -1 with the data written as far as it fits. fs_stat() and fs_lseek() take
+ * buffered data into account.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if buffered data cannot be written when turning buffered writes
+ * off. 0 otherwise.
+ */
+int fs_buffer(int fd, int enable);
+
+/**
+ * fs_advise - Tell how a file is going to be accessed
+ * @fd: File descriptor
+ * @offset: Start of the range the hint is about
+ * @len: Length of the range, 0 for up to the end of the file
+ * @hint: One of the %FS_ADV_* access hints
+ *
+ * %FS_ADV_NORMAL, %FS_ADV_SEQUENTIAL, %FS_ADV_RANDOM and %FS_ADV_NOREUSE set
+ * the access pattern of file descriptor @fd for the whole file, and @offset
+ * and @len are ignored. Reads through a descriptor with no pattern read ahead
+ * a window that grows as long as they are sequential and is lost on the first
+ * random read. A sequential descriptor always reads ahead the largest window,
+ * and a random one never reads ahead. The blocks read or written through a
+ * no-reuse descriptor are the first evicted from the cache, so that a scan
+ * does not push out the data other descriptors work on.
+ *
+ * %FS_ADV_WILLNEED reads the blocks of the range into the cache, as far as it
+ * holds them, and %FS_ADV_DONTNEED drops them from the cache after writing
+ * the data buffered for the file. Neither changes the access pattern.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), if @hint is unknown, or if the blocks of the range cannot be read or
+ * written. 0 otherwise.
+ */
+int fs_advise(int fd, size_t offset, size_t len, int hint);
+
+/**
+ * fs_map - Map a file in memory
+ * @fd: File descriptor
+ * @len: Pointer receiving the size of the mapping
+ *
+ * Give read-only access to the content of the file referenced by file
+ * descriptor @fd without copying it: the file's data blocks are mapped straight
+ * from the virtual disk file, one after the other. The mapping reflects later
+ * writes to the file, but not changes to its size or to its blocks. Data read
+ * through the mapping is not checked against %FS_FEAT_CRC32C checksums.
+ *
+ * Return: NULL if file descriptor @fd is invalid (out of bounds or not
+ * currently open), if the file is empty, packed or has compressed data, or if
+ * the disk cannot be mapped (see block_map()). Otherwise return the address of
+ * the first byte of the file, and set @len to the size of the file.
+ */
+void *fs_map(int fd, size_t *len);
+
+/**
+ * fs_unmap - Unmap a file
+ * @addr: Address returned by fs_map()
+ * @len: Size of the mapping, as returned by fs_map()
+ *
+ * Return: -1 if @addr is NULL or the mapping cannot be removed. 0 otherwise.
+ */
+int fs_unmap(void *addr, size_t len);
+
+/**
+ * fs_clone - Clone a file
+ * @src: Name of the file to clone
+ * @dst: Name of the new file
+ *
+ * Create a new file named @dst with the same content as file @src, without
+ * copying any data: both files share their data blocks, and a shared block is
+ * only copied when one of the files writes to it. The clone uses as many FAT
+ * entries as @src, but no extra data blocks. Requires %FS_FEAT_REFLINK.
+ *
+ * Return: -1 if %FS_FEAT_REFLINK is not enabled, if @src cannot be found, if
+ * @dst is invalid or already exists, if the root directory is full, or if
+ * there are not enough free FAT entries. 0 otherwise.
+ */
+int fs_clone(const char *src, const char *dst);
+
+/**
+ * fs_extents - Measure the fragmentation of a file
+ * @fd: File descriptor
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open). Otherwise return the number of runs of consecutive data blocks the
+ * file referenced by file descriptor @fd is made of, 0 for an empty file.
+ */
+int fs_extents(int fd);
+
+/**
+ * fs_defrag - Defragment the file system
+ * @budget: Maximum number of data blocks to move
+ *
+ * Make files more contiguous by moving at most @budget of their data blocks.
+ * A file grows its first run of consecutive blocks one block at a time, or
+ * starts over in a free run large enough for the whole file when the block
+ * following the run is in use. Each call resumes where the previous one
+ * stopped, so the file system can be defragmented a bit at a time while it is
+ * being used. A call that moves blocks makes the metadata durable, as
+ * fs_sync() does, before the blocks moved away from are freed, so a crash never
+ * leaves a file pointing to reused blocks. Mappings made with fs_map() do not
+ * follow moved blocks.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if @budget is not
+ * positive, if a block cannot be moved, or if the metadata cannot be synced.
+ * Otherwise return the number of blocks moved, 0 once no file can be made more
+ * contiguous.
+ */
+int fs_defrag(int budget);
+
+/**
+ * fs_clean - Clean the log of the file system
+ * @budget: Maximum number of data blocks to move
+ *
+ * For %FS_FEAT_LOG: pick the segment of consecutive data blocks with the
+ * fewest blocks in use, and move at most @budget of them to the log head, so
+ * that the segment becomes free for later writes. Segments mostly in use and
+ * the segment holding the log head are left alone. Meant to be called a bit at
+ * a time while the file system is in use. Mappings made with fs_map() do not
+ * follow moved blocks.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if %FS_FEAT_LOG is not
+ * enabled, if @budget is not positive, or if blocks cannot be moved. Otherwise
+ * return the number of blocks moved, 0 once no segment is worth cleaning.
+ */
+int fs_clean(int budget);
+
+/**
+ * fs_feature_enable - Enable an optional file system feature
+ * @feature: Feature to enable (one of the %FS_FEAT_* values)
+ *
+ * Turn on @feature for the currently mounted file system. The feature is
+ * recorded in the superblock and stays enabled across mounts. Features that
+ * need an on-disk area reserve it from the last data blocks of the disk, which
+ * must not be used by any file.
+ *
+ * With %FS_FEAT_COMPRESS, file data is compressed by units of consecutive
+ * blocks. A unit whose compressed form saves at least one block is stored in
+ * its first blocks and the remaining ones are discarded. The unit keeps all of
+ * its FAT entries, so compression does not make room for more data in the file
+ * system: it only saves space on the host, where the discarded blocks become
+ * holes in the disk image. Writes are several times slower, as every write
+ * recompresses the whole units it touches.
+ *
+ * With %FS_FEAT_CRC32C, the checksum of each data block is recorded when it is
+ * written and checked whenever the block is read from the disk (blocks served
+ * from the cache are not checked again). A mismatch makes the read fail.
+ *
+ * With %FS_FEAT_JOURNAL, metadata changes (FAT entries, directory slots and
+ * feature tables) are logged to a journal area, in groups committed every few
+ * operations or on fs_sync(). Committed groups are replayed by fs_mount() if
+ * the file system was not unmounted cleanly.
+ *
+ * With %FS_FEAT_REFLINK, several FAT entries may refer to the same data block,
+ * which makes fs_clone() possible. It cannot be combined with
+ * %FS_FEAT_COMPRESS.
+ *
+ * With %FS_FEAT_TAILPACK, files of up to half a block are packed together in
+ * shared data blocks instead of taking a block each. A packed file that grows
+ * larger gets blocks of its own.
+ *
+ * With %FS_FEAT_DEDUP, a data block about to be written with the same content
+ * as a block already on the disk is made to share it instead, found through an
+ * in-memory index of block fingerprints confirmed by comparing the blocks. The
+ * index starts empty at mount time and learns the blocks read and written.
+ * Packed blocks, fs_defrag() moves and compressed data are not deduplicated.
+ * Requires %FS_FEAT_REFLINK.
+ *
+ * With %FS_FEAT_LOG, data blocks are never overwritten in place: every block
+ * written goes to the next free data block after the log head, so that writes
+ * to many files land one after the other on the disk, and the block it
+ * replaces is freed. fs_clean() compacts the sparsest segments to keep free
+ * room ahead of the head. Metadata updates are made sequential by
+ * %FS_FEAT_JOURNAL. Requires %FS_FEAT_REFLINK.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if @feature is unknown,
+ * if there is not enough room at the end of the disk for the feature's
+ * on-disk area, or if @feature conflicts with an enabled feature or needs one
+ * that is not enabled. 0 otherwise.
+ */
+int fs_feature_enable(int feature);
+
 #endif /* _FS_H */
@@ -0,0 +1,101 @@
+#ifndef _FS_LAYOUT_H
+#define _FS_LAYOUT_H
+
+/*
+ * On-disk format of ECS150FS, shared by the library and the tools working on
+ * images directly
+ */
+
+#include <stdint.h>
+
+#include "disk.h"
+#include "fs.h"
+
+#define FAT_EOC 0xFFFF
+
+/* FAT entry of a block shared by packed small files */
+#define FAT_PACK 0xFFFE
+
+/* largest file stored packed */
+#define PACK_MAX_SIZE (BLOCK_SIZE / 2)
+
+/* files are compressed by units of consecutive blocks */
+#define COMP_UNIT_BLK 8
+
+/* a compressed unit starts with the compressed and raw lengths */
+#define COMP_HDR_SIZE 8
+
+/* journal block signature ("JRNL") */
+#define JOURNAL_MAGIC 0x4c4e524a
+
+/* journal record types */
+#define JREC_BLK 1
+#define JREC_DIR 2
+
+/* features this implementation knows about */
+#define FS_FEAT_ALL (FS_FEAT_COMPRESS | FS_FEAT_CRC32C | FS_FEAT_JOURNAL | FS_FEAT_REFLINK | FS_FEAT_TAILPACK | FS_FEAT_DEDUP | FS_FEAT_LOG)
+
+/* 
+*	structure of the file system:
+* 	super_block | FAT | root_directory | DATA ... | feature areas
+*
+*	feature areas are carved off the end of the data blocks when a feature is
+*	enabled, images without features keep the original layout
+*/
+
+struct super_block {
+	/* super block occupy [1] block */
+	uint8_t signature[8];				/* [8 bytes] Signature (must be equal to "ECS150FS") */
+	uint16_t total_virtual_blk;			/* [2 bytes] Total amount of blocks of virtual disk */
+	uint16_t root_dir_index;			/* [2 bytes] Root directory block index */
+	uint16_t data_index;				/* [2 bytes] Data block start index */
+	uint16_t total_data_blk;			/* [2 bytes] Amount of data blocks */
+	uint8_t total_FAT_blk;				/* [1 byte] Number of blocks for FAT */
+	uint32_t features;				/* [4 bytes] Enabled optional features (FS_FEAT_*) */
+	uint16_t cmap_index;				/* [2 bytes] Compression map start block index */
+	uint16_t crc_index;				/* [2 bytes] Checksum area start block index */
+	uint16_t journal_index;				/* [2 bytes] Journal start block index */
+	uint16_t journal_blk;				/* [2 bytes] Number of blocks for the journal */
+	uint32_t journal_seq;				/* [4 bytes] Sequence number of the first group to replay */
+	uint16_t remap_index;				/* [2 bytes] Remap table start block index */
+	uint16_t log_head;				/* [2 bytes] Next data block written in log-structured mode */
+	uint8_t padding[4059];				/* [4059 bytes] Unused/Padding */
+}__attribute__((packed));
+
+struct root_directory {
+	/* root_directory occupy [1] block with 128 entries*/
+	uint8_t file_name[FS_FILENAME_LEN];		/* [16 bytes] Filename (including NULL character) */
+	uint32_t file_size;				/* [4 bytes] Size of the file (in bytes) */
+	uint16_t ini_data_index;			/* [2 bytes] Index of the first data block */
+	uint16_t pack_index;				/* [2 bytes] Index of the packed block holding the file (0 if none) */
+	uint16_t pack_offset;				/* [2 bytes] Offset of the file in its packed block */
+	uint8_t padding[6];				/* [6 bytes] Unused/Padding */
+}__attribute__((packed));
+
+struct journal_header {
+	/* every journal block starts with a header */
+	uint32_t magic;					/* [4 bytes] Signature (JOURNAL_MAGIC) */
+	uint32_t seq;					/* [4 bytes] Sequence number of the group */
+	uint32_t crc;					/* [4 bytes] CRC32C of the block, computed with this field at 0 */
+	uint16_t used;					/* [2 bytes] Bytes of records following the header */
+	uint16_t commit;				/* [2 bytes] Last block of the group */
+}__attribute__((packed));
+
+struct journal_blk_rec {
+	/* state of one data block: FAT entry and feature tables */
+	uint8_t type;					/* [1 byte] JREC_BLK */
+	uint8_t comp_blk;				/* [1 byte] Compression map entry */
+	uint16_t fat_index;				/* [2 bytes] FAT index of the block */
+	uint16_t fat_value;				/* [2 bytes] FAT entry */
+	uint32_t crc;					/* [4 bytes] Checksum area entry */
+	uint16_t remap;					/* [2 bytes] Remap table entry */
+}__attribute__((packed));
+
+struct journal_dir_rec {
+	/* one root directory slot */
+	uint8_t type;					/* [1 byte] JREC_DIR */
+	uint8_t slot;					/* [1 byte] Index in the root directory */
+	struct root_directory entry;			/* [32 bytes] Content of the slot */
+}__attribute__((packed));
+
+#endif /* _FS_LAYOUT_H */
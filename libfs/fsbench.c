@@ -0,0 +1,759 @@
+/*
+ * fsbench - Benchmark libfs
+ *
+ * Format a scratch virtual disk and run workloads on it, reporting for each one
+ * its throughput, operation rate, latency percentiles, the block requests it
+ * made to the disk, and the space left in use: data blocks used by files and
+ * blocks allocated to the image file, which shows what compression saves.
+ * Every workload starts from a freshly formatted disk.
+ *
+ * Usage: fsbench [-d diskname] [-b data blocks] [-s io size] [-n ops]
+ *                [-S file size] [-f feature,...] [-w workload,...] [-B]
+ *                [-a hint] [-r blockd]
+ *
+ * Workloads: seqwrite, seqread, randwrite, randread, append, smallfiles (-n
+ * files created, written and deleted), batchfiles (the same with batched
+ * creations and deletions), mixed (70% random reads, 30% random writes),
+ * openclose (opening and closing at random the files of a full directory) and
+ * fatscan, which times the FAT scans on a full-size FAT without
+ * any disk. With -B, the files are written with buffered writes (see
+ * fs_buffer()), and the time taken to close them is counted. With -a, the
+ * files are opened with an access hint (normal, sequential, random or
+ * noreuse, see fs_advise()). With -r, the scratch disk is served by the given
+ * blockd program on the Unix socket <diskname>.sock, and the workloads go
+ * through the socket.
+ */
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blockd.h"
+
+#include "disk.h"
+#include "fat_scan.h"
+#include "fs.h"
+
+/* Number of entries of the largest possible FAT */
+#define FATSCAN_ENTRIES 65536
+
+/* Benchmark settings */
+struct bench_opts {
+	const char *diskname;
+	size_t data_blk;
+	size_t io_size;
+	size_t ops;
+	size_t file_size;
+	int features;
+	int buffered;
+	int advice;
+	const char *server;
+};
+
+/* Measures of one run */
+struct bench_result {
+	uint64_t *lat;		/* Latency of each operation, in ns */
+	size_t ops;		/* Operations done */
+	size_t bytes;		/* Bytes read or written */
+	uint64_t elapsed;	/* Time spent in the operations, in ns */
+	size_t used_blk;	/* Data blocks in use at the end */
+	size_t disk_blk;	/* Blocks allocated to the image file at the end */
+};
+
+struct workload {
+	const char *name;
+	int (*prepare)(const struct bench_opts *opts);
+	int (*run)(const struct bench_opts *opts, struct bench_result *res);
+};
+
+static const struct {
+	const char *name;
+	int feature;
+} features[] = {
+	{ "compress", FS_FEAT_COMPRESS },
+	{ "crc32c", FS_FEAT_CRC32C },
+	{ "journal", FS_FEAT_JOURNAL },
+	{ "reflink", FS_FEAT_REFLINK },
+	{ "tailpack", FS_FEAT_TAILPACK },
+	{ "dedup", FS_FEAT_DEDUP },
+	{ "log", FS_FEAT_LOG },
+};
+
+static const struct {
+	const char *name;
+	int hint;
+} hints[] = {
+	{ "normal", FS_ADV_NORMAL },
+	{ "sequential", FS_ADV_SEQUENTIAL },
+	{ "random", FS_ADV_RANDOM },
+	{ "noreuse", FS_ADV_NOREUSE },
+};
+
+static char *io_buf;
+
+/* Block server spawned with -r, and the socket it serves the disk on */
+static pid_t server_pid = -1;
+static struct sockaddr_un server_addr = { .sun_family = AF_UNIX };
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Time one operation */
+#define TIMED(res, expr) \
+	({ \
+		uint64_t __start = now_ns(); \
+		int __ret = (expr); \
+		uint64_t __lat = now_ns() - __start; \
+		(res)->lat[(res)->ops++] = __lat; \
+		(res)->elapsed += __lat; \
+		__ret; \
+	})
+
+/* Time one call working on @n files, each of them counting as an operation */
+#define TIMED_BATCH(res, n, expr) \
+	({ \
+		uint64_t __start = now_ns(); \
+		int __ret = (expr); \
+		uint64_t __lat = now_ns() - __start; \
+		for (int __i = 0; __i < (n); __i++) \
+			(res)->lat[(res)->ops++] = __lat / (n); \
+		(res)->elapsed += __lat; \
+		__ret; \
+	})
+
+/* Fill the I/O buffer with data that compresses about 2:1 */
+static void fill_buf(char *buf, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		buf[i] = (i / 16) % 2 ? rand() : 'a' + (int)(i % 8);
+}
+
+/* Offset of a random I/O within the file */
+static size_t rand_offset(const struct bench_opts *opts)
+{
+	size_t slots = opts->file_size / opts->io_size;
+
+	return (size_t)(rand() % (slots ? slots : 1)) * opts->io_size;
+}
+
+/* Open a file, with buffered writes and an access hint if asked to */
+static int open_file(const char *name, const struct bench_opts *opts)
+{
+	int fd = fs_open(name);
+
+	if (fd >= 0 && opts->buffered)
+		fs_buffer(fd, 1);
+	if (fd >= 0 && opts->advice != FS_ADV_NORMAL)
+		fs_advise(fd, 0, 0, opts->advice);
+
+	return fd;
+}
+
+/* Close a file, counting the time spent writing buffered data */
+static int close_file(int fd, struct bench_result *res)
+{
+	uint64_t start = now_ns();
+	int ret = fs_close(fd);
+
+	res->elapsed += now_ns() - start;
+
+	return ret;
+}
+
+/* Create the benchmark file with the given size */
+static int make_file(size_t size)
+{
+	int fd;
+
+	if (fs_create("bench") || (fd = fs_open("bench")) < 0)
+		return -1;
+
+	for (size_t done = 0; done < size;) {
+		size_t len = size - done < BLOCK_SIZE * 16 ? size - done
+							 : BLOCK_SIZE * 16;
+		char chunk[BLOCK_SIZE * 16];
+
+		fill_buf(chunk, len);
+		if (fs_write(fd, chunk, len) != (int)len)
+			return -1;
+		done += len;
+	}
+
+	return fs_close(fd);
+}
+
+static int prepare_file(const struct bench_opts *opts)
+{
+	return make_file(opts->file_size);
+}
+
+/* Fill the root directory with small files */
+static int prepare_dir(const struct bench_opts *opts)
+{
+	char name[FS_FILENAME_LEN];
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		int fd;
+
+		snprintf(name, sizeof(name), "file%d", i);
+		if (fs_create(name) || (fd = fs_open(name)) < 0 ||
+		    fs_write(fd, io_buf, opts->io_size) < 0 || fs_close(fd))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int prepare_empty(const struct bench_opts *opts)
+{
+	(void)opts;
+
+	return make_file(0);
+}
+
+static int prepare_none(const struct bench_opts *opts)
+{
+	(void)opts;
+
+	return 0;
+}
+
+static int run_seqwrite(const struct bench_opts *opts, struct bench_result *res)
+{
+	int fd = open_file("bench", opts);
+
+	for (size_t i = 0; i < opts->ops; i++) {
+		size_t off = (i * opts->io_size) % opts->file_size;
+
+		if (fs_lseek(fd, off <= (size_t)fs_stat(fd) ? off : 0) ||
+		    TIMED(res, fs_write(fd, io_buf, opts->io_size)) < 0)
+			return -1;
+		res->bytes += opts->io_size;
+	}
+
+	return close_file(fd, res);
+}
+
+static int run_seqread(const struct bench_opts *opts, struct bench_result *res)
+{
+	int fd = open_file("bench", opts);
+
+	for (size_t i = 0; i < opts->ops; i++) {
+		size_t off = (i * opts->io_size) % opts->file_size;
+
+		if (fs_lseek(fd, off) ||
+		    TIMED(res, fs_read(fd, io_buf, opts->io_size)) < 0)
+			return -1;
+		res->bytes += opts->io_size;
+	}
+
+	return close_file(fd, res);
+}
+
+static int run_randwrite(const struct bench_opts *opts,
+			 struct bench_result *res)
+{
+	int fd = open_file("bench", opts);
+
+	for (size_t i = 0; i < opts->ops; i++) {
+		if (fs_lseek(fd, rand_offset(opts)) ||
+		    TIMED(res, fs_write(fd, io_buf, opts->io_size)) < 0)
+			return -1;
+		res->bytes += opts->io_size;
+	}
+
+	return close_file(fd, res);
+}
+
+static int run_randread(const struct bench_opts *opts, struct bench_result *res)
+{
+	int fd = open_file("bench", opts);
+
+	for (size_t i = 0; i < opts->ops; i++) {
+		if (fs_lseek(fd, rand_offset(opts)) ||
+		    TIMED(res, fs_read(fd, io_buf, opts->io_size)) < 0)
+			return -1;
+		res->bytes += opts->io_size;
+	}
+
+	return close_file(fd, res);
+}
+
+static int run_append(const struct bench_opts *opts, struct bench_result *res)
+{
+	int fd = open_file("bench", opts);
+
+	for (size_t i = 0; i < opts->ops; i++) {
+		/* Start over once the file is as large as allowed */
+		if ((size_t)fs_stat(fd) + opts->io_size > opts->file_size &&
+		    fs_truncate(fd, 0))
+			return -1;
+
+		if (fs_lseek(fd, fs_stat(fd)) ||
+		    TIMED(res, fs_write(fd, io_buf, opts->io_size)) < 0)
+			return -1;
+		res->bytes += opts->io_size;
+	}
+
+	return close_file(fd, res);
+}
+
+/* Create, write and close files, then delete them, a directory full at a time */
+static int run_smallfiles(const struct bench_opts *opts,
+			  struct bench_result *res)
+{
+	char name[FS_FILENAME_LEN];
+	size_t done = 0;
+
+	while (done < opts->ops) {
+		int batch = 0;
+
+		for (; batch < FS_FILE_MAX_COUNT && done < opts->ops; batch++) {
+			int fd;
+
+			snprintf(name, sizeof(name), "small%d", batch);
+			if (TIMED(res, fs_create(name)) ||
+			    (fd = open_file(name, opts)) < 0 ||
+			    TIMED(res, fs_write(fd, io_buf, opts->io_size)) < 0 ||
+			    close_file(fd, res))
+				return -1;
+			res->bytes += opts->io_size;
+			done++;
+		}
+
+		for (int i = 0; i < batch; i++) {
+			snprintf(name, sizeof(name), "small%d", i);
+			if (TIMED(res, fs_delete(name)))
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Same as smallfiles, with each directory full created and deleted in one call */
+static int run_batchfiles(const struct bench_opts *opts,
+			  struct bench_result *res)
+{
+	char names[FS_FILE_MAX_COUNT][FS_FILENAME_LEN];
+	const char *list[FS_FILE_MAX_COUNT];
+	int results[FS_FILE_MAX_COUNT];
+	size_t done = 0;
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		snprintf(names[i], sizeof(names[i]), "small%d", i);
+		list[i] = names[i];
+	}
+
+	while (done < opts->ops) {
+		int batch = opts->ops - done < FS_FILE_MAX_COUNT ?
+			    (int)(opts->ops - done) : FS_FILE_MAX_COUNT;
+
+		if (TIMED_BATCH(res, batch, fs_create_many(list, batch, results)) != batch)
+			return -1;
+
+		for (int i = 0; i < batch; i++) {
+			int fd;
+
+			if ((fd = open_file(names[i], opts)) < 0 ||
+			    TIMED(res, fs_write(fd, io_buf, opts->io_size)) < 0 ||
+			    close_file(fd, res))
+				return -1;
+			res->bytes += opts->io_size;
+		}
+
+		if (TIMED_BATCH(res, batch, fs_delete_many(list, batch, results)) != batch)
+			return -1;
+
+		done += batch;
+	}
+
+	return 0;
+}
+
+/* Open a file of the directory, look at its size and close it */
+static int run_openclose(const struct bench_opts *opts,
+			 struct bench_result *res)
+{
+	char name[FS_FILENAME_LEN];
+
+	for (size_t i = 0; i < opts->ops; i++) {
+		int fd;
+
+		snprintf(name, sizeof(name), "file%d", rand() % FS_FILE_MAX_COUNT);
+		if ((fd = TIMED(res, fs_open(name))) < 0 ||
+		    TIMED(res, fs_stat(fd)) < 0 ||
+		    TIMED(res, fs_close(fd)))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int run_mixed(const struct bench_opts *opts, struct bench_result *res)
+{
+	int fd = open_file("bench", opts);
+
+	for (size_t i = 0; i < opts->ops; i++) {
+		int write_op = rand() % 10 < 3;
+
+		if (fs_lseek(fd, rand_offset(opts)))
+			return -1;
+
+		if (write_op ? TIMED(res, fs_write(fd, io_buf, opts->io_size)) < 0
+			     : TIMED(res, fs_read(fd, io_buf, opts->io_size)) < 0)
+			return -1;
+		res->bytes += opts->io_size;
+	}
+
+	return close_file(fd, res);
+}
+
+/* Each operation is one of the FAT scans over a whole, half used FAT */
+static int run_fatscan(const struct bench_opts *opts, struct bench_result *res)
+{
+	uint16_t *fat = malloc(sizeof(uint16_t) * FATSCAN_ENTRIES);
+	volatile size_t sink = 0;
+
+	for (size_t i = 0; i < FATSCAN_ENTRIES; i++)
+		fat[i] = i < FATSCAN_ENTRIES / 2 ? i + 1 : 0;
+
+	for (size_t i = 0; i < opts->ops; i++) {
+		switch (i % 3) {
+		case 0:
+			sink += TIMED(res, (int)fat_count_free(fat, FATSCAN_ENTRIES));
+			break;
+		case 1:
+			sink += TIMED(res, (int)fat_find_free(fat, 0, FATSCAN_ENTRIES));
+			break;
+		default:
+			sink += TIMED(res, (int)fat_find_invalid(fat, FATSCAN_ENTRIES,
+								 0xFFF0, 0xFFFE));
+			break;
+		}
+		res->bytes += sizeof(uint16_t) * FATSCAN_ENTRIES;
+	}
+
+	(void)sink;
+	free(fat);
+
+	return 0;
+}
+
+static const struct workload workloads[] = {
+	{ "seqwrite", prepare_empty, run_seqwrite },
+	{ "seqread", prepare_file, run_seqread },
+	{ "randwrite", prepare_file, run_randwrite },
+	{ "randread", prepare_file, run_randread },
+	{ "append", prepare_empty, run_append },
+	{ "smallfiles", prepare_none, run_smallfiles },
+	{ "batchfiles", prepare_none, run_batchfiles },
+	{ "mixed", prepare_file, run_mixed },
+	{ "openclose", prepare_dir, run_openclose },
+	{ "fatscan", NULL, run_fatscan },
+};
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const struct bench_result *res, int pct)
+{
+	size_t i = res->ops * pct / 100;
+
+	if (!res->ops)
+		return 0;
+	if (i >= res->ops)
+		i = res->ops - 1;
+
+	return res->lat[i] / 1000.0;
+}
+
+/* Serve the scratch disk with the blockd program @opts->server */
+static int start_server(const struct bench_opts *opts)
+{
+	if (snprintf(server_addr.sun_path, sizeof(server_addr.sun_path),
+		     "%s.sock", opts->diskname) >= (int)sizeof(server_addr.sun_path)) {
+		fprintf(stderr, "fsbench: socket path too long\n");
+		return -1;
+	}
+	unlink(server_addr.sun_path);
+
+	server_pid = fork();
+	if (server_pid < 0) {
+		perror("fork");
+		return -1;
+	}
+	if (!server_pid) {
+		execl(opts->server, opts->server, opts->diskname,
+		      server_addr.sun_path, (char *)NULL);
+		perror(opts->server);
+		_exit(EXIT_FAILURE);
+	}
+
+	/* Wait for the server to listen, probing it without a disk request */
+	for (int tries = 0; tries < 1000; tries++) {
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		int ret = connect(fd, (struct sockaddr *)&server_addr,
+				  sizeof(server_addr));
+
+		close(fd);
+		if (!ret)
+			return 0;
+
+		if (waitpid(server_pid, NULL, WNOHANG) == server_pid) {
+			server_pid = -1;
+			return -1;
+		}
+		usleep(1000);
+	}
+
+	fprintf(stderr, "fsbench: %s does not answer\n", opts->server);
+
+	return -1;
+}
+
+static void stop_server(void)
+{
+	if (server_pid < 0)
+		return;
+
+	kill(server_pid, SIGTERM);
+	waitpid(server_pid, NULL, 0);
+	server_pid = -1;
+	unlink(server_addr.sun_path);
+}
+
+/* Format the scratch disk and mount it, through the block server with -r */
+static int mount_disk(const struct bench_opts *opts)
+{
+	char name[sizeof(BLOCKD_PREFIX) + sizeof(server_addr.sun_path)];
+
+	if (fs_format(opts->diskname, opts->data_blk))
+		return -1;
+
+	if (!opts->server)
+		return fs_mount(opts->diskname);
+
+	if (start_server(opts))
+		return -1;
+
+	snprintf(name, sizeof(name), "%s%s", BLOCKD_PREFIX, server_addr.sun_path);
+
+	return fs_mount(name);
+}
+
+static int run_workload(const struct workload *wl, const struct bench_opts *opts)
+{
+	struct bench_result res = { 0 };
+	struct block_stats st;
+	int ret = -1;
+
+	/* Each small file makes three timed operations */
+	res.lat = malloc(sizeof(uint64_t) * opts->ops * 3);
+
+	if (wl->prepare) {
+		if (mount_disk(opts))
+			goto out;
+
+		for (size_t i = 0; i < sizeof(features) / sizeof(features[0]); i++) {
+			if ((opts->features & features[i].feature) &&
+			    fs_feature_enable(features[i].feature))
+				goto out_umount;
+		}
+
+		if (wl->prepare(opts))
+			goto out_umount;
+	}
+
+	/* Only the workload itself is counted, unmounting included */
+	block_reset_stats();
+	ret = wl->run(opts, &res);
+
+out_umount:
+	if (wl->prepare) {
+		struct fs_statfs sfs;
+		struct stat img;
+		uint64_t start;
+
+		if (!fs_statfs(&sfs))
+			res.used_blk = sfs.data_blk_count - sfs.data_free;
+
+		start = now_ns();
+		if (fs_umount())
+			ret = -1;
+		res.elapsed += now_ns() - start;
+
+		/* Blocks left out of the image are holes, written by no one */
+		if (!stat(opts->diskname, &img))
+			res.disk_blk = img.st_blocks * 512 / BLOCK_SIZE;
+	}
+out:
+	stop_server();
+
+	if (ret) {
+		printf("%-10s failed\n", wl->name);
+		free(res.lat);
+		return -1;
+	}
+
+	block_get_stats(&st);
+	qsort(res.lat, res.ops, sizeof(uint64_t), cmp_u64);
+
+	printf("%-10s %9.1f %10.0f %8.1f %8.1f %8.1f %9zu %9zu %6zu %9zu %9zu\n",
+	       wl->name, res.bytes / (res.elapsed / 1e9) / (1 << 20),
+	       res.ops / (res.elapsed / 1e9), percentile_us(&res, 50),
+	       percentile_us(&res, 99), percentile_us(&res, 100),
+	       st.read_blocks, st.write_blocks, st.syncs, res.used_blk,
+	       res.disk_blk);
+
+	free(res.lat);
+
+	return 0;
+}
+
+static int parse_features(char *list)
+{
+	int mask = 0;
+
+	for (char *name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+		size_t i;
+
+		for (i = 0; i < sizeof(features) / sizeof(features[0]); i++) {
+			if (!strcmp(name, features[i].name))
+				break;
+		}
+
+		if (i == sizeof(features) / sizeof(features[0])) {
+			fprintf(stderr, "fsbench: unknown feature '%s'\n", name);
+			return -1;
+		}
+
+		mask |= features[i].feature;
+	}
+
+	return mask;
+}
+
+static int parse_hint(const char *name)
+{
+	for (size_t i = 0; i < sizeof(hints) / sizeof(hints[0]); i++) {
+		if (!strcmp(name, hints[i].name))
+			return hints[i].hint;
+	}
+
+	fprintf(stderr, "fsbench: unknown hint '%s'\n", name);
+
+	return -1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-d diskname] [-b data blocks] [-s io size] [-n ops]\n"
+		"       [-S file size] [-f feature,...] [-w workload,...] [-B]\n"
+		"       [-a hint] [-r blockd]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_opts opts = {
+		.diskname = "fsbench.img",
+		.data_blk = 16384,
+		.io_size = BLOCK_SIZE,
+		.ops = 4096,
+		.file_size = 16 << 20,
+	};
+	char *selected = NULL;
+	int opt, failed = 0;
+
+	while ((opt = getopt(argc, argv, "d:b:s:n:S:f:w:Ba:r:")) != -1) {
+		switch (opt) {
+		case 'd':
+			opts.diskname = optarg;
+			break;
+		case 'b':
+			opts.data_blk = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			opts.io_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			opts.ops = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			opts.file_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			if ((opts.features = parse_features(optarg)) < 0)
+				return EXIT_FAILURE;
+			break;
+		case 'w':
+			selected = optarg;
+			break;
+		case 'B':
+			opts.buffered = 1;
+			break;
+		case 'a':
+			if ((opts.advice = parse_hint(optarg)) < 0)
+				return EXIT_FAILURE;
+			break;
+		case 'r':
+			opts.server = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!opts.io_size || !opts.ops || opts.file_size < opts.io_size) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	io_buf = malloc(opts.io_size);
+	fill_buf(io_buf, opts.io_size);
+	srand(1);
+
+	printf("%-10s %9s %10s %8s %8s %8s %9s %9s %6s %9s %9s\n", "workload",
+	       "MB/s", "ops/s", "p50(us)", "p99(us)", "max(us)", "blk_rd",
+	       "blk_wr", "syncs", "used_blk", "disk_blk");
+
+	for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+		if (selected) {
+			char *list = strdup(selected), *name;
+			int found = 0;
+
+			for (name = strtok(list, ","); name; name = strtok(NULL, ","))
+				found |= !strcmp(name, workloads[i].name);
+			free(list);
+
+			if (!found)
+				continue;
+		}
+
+		if (run_workload(&workloads[i], &opts))
+			failed = 1;
+	}
+
+	unlink(opts.diskname);
+	free(io_buf);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
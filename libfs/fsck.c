@@ -0,0 +1,355 @@
+/*
+ * fsck - Check a file system
+ *
+ * Check the file system of a virtual disk without mounting it: superblock,
+ * root directory and FAT. The FAT chains of the files are walked by several
+ * threads at once, each claiming the entries it goes through in a map shared
+ * by all of them, which reveals chains that loop or are cross-linked. Entries
+ * claimed by no file are reported as leaked. Nothing is repaired.
+ *
+ * Usage: fsck <diskname> [threads]
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "fat_scan.h"
+#include "fs_layout.h"
+
+#define fsck_error(fmt, ...) \
+	do { \
+		fprintf(stdout, fmt"\n", ##__VA_ARGS__); \
+		__atomic_add_fetch(&problems, 1, __ATOMIC_RELAXED); \
+	} while (0)
+
+/* Maximum number of checking threads */
+#define FSCK_MAX_THREADS 16
+
+/* Owner of the FAT entries of packed blocks (files are 1..FS_FILE_MAX_COUNT) */
+#define PACK_OWNER 0xFF
+
+/* Leaked entries listed one by one before only counting them */
+#define LEAK_REPORT_MAX 16
+
+static struct super_block sb;
+static uint16_t *fat;
+static struct root_directory dir[FS_FILE_MAX_COUNT];
+
+/* Root directory slot + 1 of the file owning each FAT entry, 0 if none yet */
+static uint8_t *owner;
+
+/* Next root directory slot to check, shared by the threads */
+static int next_slot;
+
+static int problems;
+
+/* Read @count consecutive blocks starting at @first */
+static int read_blocks(size_t first, size_t count, void *buf)
+{
+	size_t *blocks = malloc(sizeof(size_t) * count);
+	int ret;
+
+	for (size_t i = 0; i < count; i++)
+		blocks[i] = first + i;
+
+	ret = block_read_many(blocks, count, buf);
+	free(blocks);
+
+	return ret;
+}
+
+/* Metadata area of a feature, past the data blocks */
+struct area {
+	const char *name;
+	int index;
+	int count;
+};
+
+/* Blocks of an area holding @size bytes for each data block, as fs.c sizes it */
+static int area_blk(size_t size)
+{
+	return (sb.total_data_blk * size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+/* Each area must lie between the data blocks and the end of the disk, alone */
+static void check_areas(const struct area *areas, int num_area)
+{
+	for (int i = 0; i < num_area; i++) {
+		const struct area *a = &areas[i];
+
+		if (a->index < sb.data_index + sb.total_data_blk ||
+		    a->index + a->count > sb.total_virtual_blk)
+			fsck_error("superblock: %s area at blocks %d-%d is out of bounds",
+				   a->name, a->index, a->index + a->count - 1);
+
+		for (int j = 0; j < i; j++) {
+			const struct area *b = &areas[j];
+
+			if (a->index < b->index + b->count &&
+			    b->index < a->index + a->count)
+				fsck_error("superblock: %s area overlaps %s area",
+					   a->name, b->name);
+		}
+	}
+}
+
+static int check_super(void)
+{
+	struct area areas[4];
+	int num_area = 0;
+
+	if (memcmp(sb.signature, "ECS150FS", 8)) {
+		fsck_error("superblock: bad signature");
+		return -1;
+	}
+
+	if (sb.total_virtual_blk != block_disk_count() ||
+	    sb.root_dir_index != 1 + sb.total_FAT_blk ||
+	    sb.data_index != sb.root_dir_index + 1 ||
+	    sb.total_data_blk > sb.total_FAT_blk * BLOCK_SIZE / 2 ||
+	    sb.data_index + sb.total_data_blk > sb.total_virtual_blk) {
+		fsck_error("superblock: inconsistent layout");
+		return -1;
+	}
+
+	if (sb.features & ~FS_FEAT_ALL)
+		fsck_error("superblock: unknown features 0x%x",
+			   sb.features & ~FS_FEAT_ALL);
+
+	if (sb.features & FS_FEAT_COMPRESS)
+		areas[num_area++] = (struct area){ "compression map",
+			sb.cmap_index, area_blk(sizeof(uint8_t)) };
+	if (sb.features & FS_FEAT_CRC32C)
+		areas[num_area++] = (struct area){ "checksum",
+			sb.crc_index, area_blk(sizeof(uint32_t)) };
+	if (sb.features & FS_FEAT_REFLINK)
+		areas[num_area++] = (struct area){ "remap",
+			sb.remap_index, area_blk(sizeof(uint16_t)) };
+	if (sb.features & FS_FEAT_JOURNAL)
+		areas[num_area++] = (struct area){ "journal",
+			sb.journal_index, sb.journal_blk };
+
+	check_areas(areas, num_area);
+
+	if (sb.features & FS_FEAT_JOURNAL) {
+		uint8_t blk[BLOCK_SIZE];
+		struct journal_header header;
+
+		/* The metadata in place is only final once the journal is replayed */
+		if (!block_read(sb.journal_index, blk)) {
+			memcpy(&header, blk, sizeof(header));
+			if (header.magic == JOURNAL_MAGIC &&
+			    header.seq == sb.journal_seq)
+				printf("warning: the journal was not replayed, mount the file system first\n");
+		}
+	}
+
+	return 0;
+}
+
+static void check_entry(int slot)
+{
+	struct root_directory *entry = &dir[slot];
+	const char *name = (const char *)entry->file_name;
+	int num_blk = 0;
+
+	if (entry->pack_index) {
+		uint8_t claim = 0;
+
+		if (!(sb.features & FS_FEAT_TAILPACK) ||
+		    entry->ini_data_index != FAT_EOC ||
+		    entry->pack_index >= sb.total_data_blk ||
+		    fat[entry->pack_index] != FAT_PACK ||
+		    entry->file_size > PACK_MAX_SIZE ||
+		    entry->pack_offset + entry->file_size > BLOCK_SIZE) {
+			fsck_error("file '%s': bad packed block %u", name,
+				   entry->pack_index);
+			return;
+		}
+
+		__atomic_compare_exchange_n(&owner[entry->pack_index], &claim,
+					    PACK_OWNER, 0, __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED);
+		if (claim != 0 && claim != PACK_OWNER)
+			fsck_error("file '%s': packed block %u also in the chain of '%s'",
+				   name, entry->pack_index,
+				   dir[claim - 1].file_name);
+		return;
+	}
+
+	for (int index = entry->ini_data_index; index != FAT_EOC;
+	     index = fat[index]) {
+		uint8_t claim = 0;
+
+		if (index == 0 || index >= sb.total_data_blk) {
+			fsck_error("file '%s': bad block index %d", name, index);
+			break;
+		}
+
+		if (!__atomic_compare_exchange_n(&owner[index], &claim, slot + 1,
+						 0, __ATOMIC_RELAXED,
+						 __ATOMIC_RELAXED)) {
+			if (claim == slot + 1)
+				fsck_error("file '%s': chain loops at block %d",
+					   name, index);
+			else if (claim == PACK_OWNER)
+				fsck_error("file '%s': block %d is a packed block",
+					   name, index);
+			else
+				fsck_error("file '%s': block %d cross-linked with '%s'",
+					   name, index, dir[claim - 1].file_name);
+			return;
+		}
+
+		num_blk++;
+	}
+
+	/* Blocks reserved past the end of the file are fine, missing ones not */
+	if ((size_t)num_blk * BLOCK_SIZE < entry->file_size)
+		fsck_error("file '%s': size %u needs more than the %d block(s) of its chain",
+			   name, entry->file_size, num_blk);
+}
+
+static void *check_thread(void *arg)
+{
+	int slot;
+
+	(void)arg;
+
+	while ((slot = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED)) <
+	       FS_FILE_MAX_COUNT) {
+		if (dir[slot].file_name[0])
+			check_entry(slot);
+	}
+
+	return NULL;
+}
+
+/* FAT entries must point at data blocks or be special values */
+static void check_fat(void)
+{
+	size_t count = sb.total_data_blk;
+
+	for (size_t i = fat_find_invalid(fat, count, count, FAT_PACK); i < count;
+	     i += 1 + fat_find_invalid(fat + i + 1, count - i - 1, count, FAT_PACK))
+		fsck_error("block %zu: FAT entry 0x%04x out of range", i, fat[i]);
+}
+
+static void check_dir(void)
+{
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (!dir[i].file_name[0])
+			continue;
+
+		if (!memchr(dir[i].file_name, '\0', FS_FILENAME_LEN))
+			fsck_error("slot %d: file name is not terminated", i);
+
+		for (int j = 0; j < i; j++) {
+			if (!strncmp((char *)dir[i].file_name,
+				     (char *)dir[j].file_name, FS_FILENAME_LEN))
+				fsck_error("slot %d: duplicate file name '%.*s'",
+					   i, FS_FILENAME_LEN, dir[i].file_name);
+		}
+	}
+}
+
+/* Packed files sharing a block must not overlap */
+static void check_packed(void)
+{
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		for (int j = 0; j < i; j++) {
+			struct root_directory *a = &dir[i], *b = &dir[j];
+
+			if (!a->file_name[0] || !b->file_name[0] ||
+			    !a->pack_index || a->pack_index != b->pack_index)
+				continue;
+
+			if (a->pack_offset < b->pack_offset + b->file_size &&
+			    b->pack_offset < a->pack_offset + a->file_size)
+				fsck_error("files '%s' and '%s' overlap in packed block %u",
+					   a->file_name, b->file_name,
+					   a->pack_index);
+		}
+	}
+}
+
+static void check_leaks(void)
+{
+	int leaked = 0;
+
+	for (size_t i = fat_find_used(fat, 1, sb.total_data_blk);
+	     i < sb.total_data_blk; i = fat_find_used(fat, i + 1, sb.total_data_blk)) {
+		if (owner[i])
+			continue;
+
+		if (++leaked <= LEAK_REPORT_MAX)
+			printf("block %zu: allocated (0x%04x) but used by no file\n",
+			       i, fat[i]);
+	}
+
+	if (leaked)
+		fsck_error("%d leaked block(s)", leaked);
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t threads[FSCK_MAX_THREADS];
+	long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <diskname> [threads]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (argc > 2)
+		num_threads = atoi(argv[2]);
+	if (num_threads < 1)
+		num_threads = 1;
+	if (num_threads > FSCK_MAX_THREADS)
+		num_threads = FSCK_MAX_THREADS;
+
+	if (block_disk_open(argv[1]))
+		return EXIT_FAILURE;
+
+	if (block_read(0, &sb) || check_super()) {
+		block_disk_close();
+		printf("%s: not checked\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	fat = malloc(sb.total_FAT_blk * BLOCK_SIZE);
+	owner = calloc(sb.total_data_blk, 1);
+
+	if (read_blocks(1, sb.total_FAT_blk, fat) ||
+	    block_read(sb.root_dir_index, dir)) {
+		block_disk_close();
+		return EXIT_FAILURE;
+	}
+
+	check_fat();
+	check_dir();
+
+	for (long i = 0; i < num_threads; i++)
+		pthread_create(&threads[i], NULL, check_thread, NULL);
+	for (long i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	check_packed();
+	check_leaks();
+
+	free(fat);
+	free(owner);
+	block_disk_close();
+
+	if (problems) {
+		printf("%s: %d problem(s) found\n", argv[1], problems);
+		return EXIT_FAILURE;
+	}
+
+	printf("%s: clean\n", argv[1]);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,90 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "hash64.h"
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const uint8_t* p) {
+	uint64_t v;
+
+	memcpy(&v, p, 8);
+
+	return v;
+}
+
+/* fold eight bytes into a lane */
+static uint64_t round64(uint64_t acc, uint64_t v) {
+	acc += v * PRIME2;
+	acc = rotl(acc, 31);
+
+	return acc * PRIME1;
+}
+
+static uint64_t merge64(uint64_t acc, uint64_t lane) {
+	acc ^= round64(0, lane);
+
+	return acc * PRIME1 + PRIME4;
+}
+
+uint64_t hash64(const void *buf, size_t len)
+{
+	const uint8_t* p = buf;
+	const uint8_t* end = p + len;
+	uint64_t h;
+
+	if(len >= 32) {
+		uint64_t v1 = PRIME1 + PRIME2;
+		uint64_t v2 = PRIME2;
+		uint64_t v3 = 0;
+		uint64_t v4 = -PRIME1;
+
+		/* 32 bytes per step, the lanes don't depend on each other */
+		while(end - p >= 32) {
+			v1 = round64(v1, read64(p));
+			v2 = round64(v2, read64(p + 8));
+			v3 = round64(v3, read64(p + 16));
+			v4 = round64(v4, read64(p + 24));
+			p += 32;
+		}
+
+		h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+		h = merge64(h, v1);
+		h = merge64(h, v2);
+		h = merge64(h, v3);
+		h = merge64(h, v4);
+	} else {
+		h = PRIME5;
+	}
+
+	h += len;
+
+	/* what is left, eight bytes then one byte at a time */
+	while(end - p >= 8) {
+		h ^= round64(0, read64(p));
+		h = rotl(h, 27) * PRIME1 + PRIME4;
+		p += 8;
+	}
+
+	while(p < end) {
+		h ^= *p++ * PRIME5;
+		h = rotl(h, 11) * PRIME1;
+	}
+
+	/* spread every input bit over the whole result */
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	h *= PRIME3;
+	h ^= h >> 32;
+
+	return h;
+}
@@ -0,0 +1,20 @@
+#ifndef _HASH64_H
+#define _HASH64_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+/**
+ * hash64 - Compute a 64-bit fingerprint of a buffer
+ * @buf: Data to hash
+ * @len: Size of @buf in bytes
+ *
+ * Fast non-cryptographic hash, in the style of xxHash64: four independent
+ * 64-bit lanes consume 32 bytes per step and are mixed together at the end.
+ * Equal fingerprints do not prove that the data is equal.
+ *
+ * Return: Fingerprint of the data.
+ */
+uint64_t hash64(const void *buf, size_t len);
+
+#endif /* _HASH64_H */
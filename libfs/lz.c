@@ -0,0 +1,191 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+/* shortest match worth a back-reference */
+#define LZ_MIN_MATCH 4
+
+/* the last literals of a stream are never part of a match */
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+
+/* back-references are 16-bit offsets */
+#define LZ_MAX_OFFSET 65535
+
+#define LZ_HASH_BITS 12
+
+static uint32_t read32(const uint8_t* p) {
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+
+	return v;
+}
+
+static int hash32(uint32_t v) {
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* write the 255-continued extension of a length, return NULL on overflow */
+static uint8_t* put_len(uint8_t* op, uint8_t* oend, int len) {
+	while(len >= 255) {
+		if(op >= oend)
+			return NULL;
+		*op++ = 255;
+		len -= 255;
+	}
+
+	if(op >= oend)
+		return NULL;
+	*op++ = len;
+
+	return op;
+}
+
+/* emit one sequence: literals [anchor, ip) then an optional match */
+static uint8_t* put_sequence(uint8_t* op, uint8_t* oend, const uint8_t* anchor, int lit_len, int offset, int match_len) {
+	uint8_t* token = op++;
+	int ml = match_len - LZ_MIN_MATCH;
+
+	if(token >= oend)
+		return NULL;
+
+	*token = (lit_len >= 15 ? 15 : lit_len) << 4;
+	if(lit_len >= 15 && (op = put_len(op, oend, lit_len - 15)) == NULL)
+		return NULL;
+
+	if(op + lit_len > oend)
+		return NULL;
+	memcpy(op, anchor, lit_len);
+	op += lit_len;
+
+	/* the last sequence only has literals */
+	if(match_len == 0)
+		return op;
+
+	if(op + 2 > oend)
+		return NULL;
+	*op++ = offset & 0xFF;
+	*op++ = offset >> 8;
+
+	*token |= ml >= 15 ? 15 : ml;
+	if(ml >= 15 && (op = put_len(op, oend, ml - 15)) == NULL)
+		return NULL;
+
+	return op;
+}
+
+int lz_compress(const void *src, int src_len, void *dst, int dst_cap)
+{
+	const uint8_t* base = src;
+	const uint8_t* ip = base;
+	const uint8_t* anchor = base;
+	const uint8_t* iend = base + src_len;
+	const uint8_t* mflimit = iend - LZ_MATCH_LIMIT;
+	const uint8_t* mlimit = iend - LZ_LAST_LITERALS;
+	uint8_t* op = dst;
+	uint8_t* oend = op + dst_cap;
+	int table[1 << LZ_HASH_BITS];
+
+	memset(table, -1, sizeof(table));
+
+	while(src_len >= LZ_MATCH_LIMIT && ip < mflimit) {
+		int h = hash32(read32(ip));
+		const uint8_t* ref = table[h] < 0 ? NULL : base + table[h];
+
+		table[h] = ip - base;
+
+		if(ref == NULL || ip - ref > LZ_MAX_OFFSET || read32(ref) != read32(ip)) {
+			ip++;
+			continue;
+		}
+
+		/* extend the match as far as it goes */
+		int match_len = LZ_MIN_MATCH;
+		while(ip + match_len < mlimit && ref[match_len] == ip[match_len])
+			match_len++;
+
+		op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, match_len);
+		if(op == NULL)
+			return -1;
+
+		ip += match_len;
+		anchor = ip;
+	}
+
+	op = put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+	if(op == NULL)
+		return -1;
+
+	return op - (uint8_t*)dst;
+}
+
+/* read the 255-continued extension of a length, -1 on truncated input */
+static int get_len(const uint8_t** ip, const uint8_t* iend) {
+	int len = 0;
+	int byte;
+
+	do {
+		if(*ip >= iend)
+			return -1;
+		byte = *(*ip)++;
+		len += byte;
+	} while(byte == 255);
+
+	return len;
+}
+
+int lz_decompress(const void *src, int src_len, void *dst, int dst_cap)
+{
+	const uint8_t* ip = src;
+	const uint8_t* iend = ip + src_len;
+	uint8_t* op = dst;
+	uint8_t* oend = op + dst_cap;
+
+	while(ip < iend) {
+		int token = *ip++;
+		int lit_len = token >> 4;
+		int match_len = token & 15;
+		int ext;
+
+		if(lit_len == 15) {
+			if((ext = get_len(&ip, iend)) < 0)
+				return -1;
+			lit_len += ext;
+		}
+
+		if(ip + lit_len > iend || op + lit_len > oend)
+			return -1;
+		memcpy(op, ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+
+		/* literals-only sequence ends the stream */
+		if(ip == iend)
+			break;
+
+		if(ip + 2 > iend)
+			return -1;
+		int offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		if(match_len == 15) {
+			if((ext = get_len(&ip, iend)) < 0)
+				return -1;
+			match_len += ext;
+		}
+		match_len += LZ_MIN_MATCH;
+
+		if(offset == 0 || offset > op - (uint8_t*)dst || op + match_len > oend)
+			return -1;
+
+		/* byte by byte: the match may overlap what it produces */
+		const uint8_t* ref = op - offset;
+		for(int i = 0; i < match_len; i++)
+			op[i] = ref[i];
+		op += match_len;
+	}
+
+	return op - (uint8_t*)dst;
+}
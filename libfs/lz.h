@@ -0,0 +1,34 @@
+#ifndef _LZ_H
+#define _LZ_H
+
+/*
+ * Self-contained LZ77 codec using the LZ4 block format: a sequence of tokens,
+ * each made of a run of literals followed by a back-reference (16-bit offset,
+ * match of at least 4 bytes).
+ */
+
+/**
+ * lz_compress - Compress a buffer
+ * @src: Data to compress
+ * @src_len: Size of @src in bytes
+ * @dst: Buffer receiving the compressed stream
+ * @dst_cap: Size of @dst in bytes
+ *
+ * Return: -1 if the compressed stream does not fit in @dst_cap bytes.
+ * Otherwise return the size of the compressed stream.
+ */
+int lz_compress(const void *src, int src_len, void *dst, int dst_cap);
+
+/**
+ * lz_decompress - Decompress a buffer
+ * @src: Compressed stream
+ * @src_len: Size of @src in bytes
+ * @dst: Buffer receiving the decompressed data
+ * @dst_cap: Size of @dst in bytes
+ *
+ * Return: -1 if the stream is malformed or if the decompressed data does not fit
+ * in @dst_cap bytes. Otherwise return the size of the decompressed data.
+ */
+int lz_decompress(const void *src, int src_len, void *dst, int dst_cap);
+
+#endif /* _LZ_H */
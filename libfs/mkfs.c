@@ -0,0 +1,91 @@
+/*
+ * mkfs - Create a file system
+ *
+ * Create a virtual disk file holding an empty file system with the given
+ * number of data blocks, see fs_format(). Optional features are enabled
+ * right away, by name.
+ *
+ * Usage: mkfs <diskname> <data block count> [compress|crc32c|journal|reflink|tailpack|dedup|log...]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fs.h"
+
+static const struct {
+	const char *name;
+	int feature;
+} features[] = {
+	{ "compress", FS_FEAT_COMPRESS },
+	{ "crc32c", FS_FEAT_CRC32C },
+	{ "journal", FS_FEAT_JOURNAL },
+	{ "reflink", FS_FEAT_REFLINK },
+	{ "tailpack", FS_FEAT_TAILPACK },
+	{ "dedup", FS_FEAT_DEDUP },
+	{ "log", FS_FEAT_LOG },
+};
+
+static int feature_by_name(const char *name)
+{
+	for (size_t i = 0; i < sizeof(features) / sizeof(features[0]); i++) {
+		if (!strcmp(name, features[i].name))
+			return features[i].feature;
+	}
+
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	char *end;
+	long count;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <diskname> <data block count> [feature...]\n",
+			argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	count = strtol(argv[2], &end, 0);
+	if (*end || count <= 0) {
+		fprintf(stderr, "mkfs: invalid block count '%s'\n", argv[2]);
+		return EXIT_FAILURE;
+	}
+
+	for (int i = 3; i < argc; i++) {
+		if (feature_by_name(argv[i]) < 0) {
+			fprintf(stderr, "mkfs: unknown feature '%s'\n", argv[i]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (fs_format(argv[1], count)) {
+		fprintf(stderr, "mkfs: cannot create %s with %ld data blocks\n",
+			argv[1], count);
+		return EXIT_FAILURE;
+	}
+
+	if (argc == 3)
+		return EXIT_SUCCESS;
+
+	if (fs_mount(argv[1])) {
+		fprintf(stderr, "mkfs: cannot mount %s\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	for (int i = 3; i < argc; i++) {
+		if (fs_feature_enable(feature_by_name(argv[i]))) {
+			fprintf(stderr, "mkfs: cannot enable %s\n", argv[i]);
+			fs_umount();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (fs_umount()) {
+		fprintf(stderr, "mkfs: cannot unmount %s\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -1,14 +1,97 @@
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "private.h"
 #include "uthread.h"
 
-/* Size of the stack for a thread (in bytes) */
+/* Default size of the stack for a thread (in bytes) */
 #define UTHREAD_STACK_SIZE 32768
 
+/* Smallest stack, leaving room for the frame of the preemption signal handler */
+#define UTHREAD_STACK_MIN 16384
+
+/* Maximum number of stacks of exited threads kept mapped for new threads */
+#define UTHREAD_STACK_CACHE 16
+
+/*
+ * Default-size stacks of exited threads ready for reuse, most recently used
+ * first. Each cached stack holds the pointer to the next one in its first
+ * bytes.
+ */
+static void *stack_cache;
+static int stack_cache_count;
+static size_t page_size;
+
+#ifdef UTHREAD_CTX_ASM
+/* Default x87 control word and MXCSR of a new thread */
+#define UTHREAD_FPU_CW 0x037F
+#define UTHREAD_MXCSR 0x1F80
+
+/*
+ * uthread_ctx_swap - Save the callee-saved registers, the x87 control word and
+ * MXCSR on the current stack, store the stack pointer in @prev_sp, then load
+ * @next_sp and restore the same registers from the stack it points to.
+ *
+ * Signals are blocked whenever threads are switched (see uthread_yield()), and
+ * the signal mask is the same for every thread at that point, so it needs no
+ * saving: preempting from the signal handler goes through the same path, the
+ * full state of the interrupted thread being in its signal frame.
+ */
+void uthread_ctx_swap(void **prev_sp, void *next_sp);
+
+/*
+ * uthread_ctx_trampoline - First code run by a new context: call
+ * uthread_ctx_bootstrap() (in %r14) with @func (in %r12) and @arg (in %r13)
+ */
+void uthread_ctx_trampoline(void);
+
+__asm__(
+	".text\n"
+	".globl uthread_ctx_swap\n"
+	".type uthread_ctx_swap, @function\n"
+	"uthread_ctx_swap:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size uthread_ctx_swap, .-uthread_ctx_swap\n"
+	"\n"
+	".globl uthread_ctx_trampoline\n"
+	".type uthread_ctx_trampoline, @function\n"
+	"uthread_ctx_trampoline:\n"
+	"	movq %r12, %rdi\n"
+	"	movq %r13, %rsi\n"
+	"	call *%r14\n"
+	"	ud2\n"
+	".size uthread_ctx_trampoline, .-uthread_ctx_trampoline\n"
+);
+#endif
+
 void uthread_ctx_switch(uthread_ctx_t *prev, uthread_ctx_t *next)
 {
+#ifdef UTHREAD_CTX_ASM
+	uthread_ctx_swap(&prev->sp, next->sp);
+#else
 	/*
 	 * swapcontext() saves the current context in structure pointer by @prev
 	 * and actives the context pointed by @next
@@ -17,16 +100,100 @@ void uthread_ctx_switch(uthread_ctx_t *prev, uthread_ctx_t *next)
 		perror("swapcontext");
 		exit(1);
 	}
+#endif
 }
 
-void *uthread_ctx_alloc_stack(void)
+size_t uthread_ctx_stack_size(size_t size)
 {
-	return malloc(UTHREAD_STACK_SIZE);
+	if (!page_size)
+		page_size = sysconf(_SC_PAGESIZE);
+
+	if (!size)
+		size = UTHREAD_STACK_SIZE;
+	if (size < UTHREAD_STACK_MIN)
+		size = UTHREAD_STACK_MIN;
+
+	return (size + page_size - 1) & ~(page_size - 1);
 }
 
-void uthread_ctx_destroy_stack(void *top_of_stack)
+/* Only default stacks with a guard page are cached, they are all alike */
+static int stack_cacheable(size_t size, int guard)
 {
-	free(top_of_stack);
+	return guard && size == uthread_ctx_stack_size(0);
+}
+
+void *uthread_ctx_alloc_stack(size_t size, int guard)
+{
+	size_t guard_size;
+	uint8_t *mapping;
+
+	size = uthread_ctx_stack_size(size);
+	guard_size = guard ? page_size : 0;
+
+	/* A recently used stack is likely still in the caches */
+	if (stack_cache && stack_cacheable(size, guard)) {
+		void *stack = stack_cache;
+
+		stack_cache = *(void **)stack;
+		stack_cache_count--;
+
+		return stack;
+	}
+
+	/*
+	 * Pages are only committed once touched: a large stack costs nothing
+	 * until the thread goes deep into it. The stack grows down towards an
+	 * inaccessible guard page, so that an overflow faults instead of
+	 * corrupting whatever lies below.
+	 */
+	mapping = mmap(NULL, guard_size + size, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_NORESERVE,
+		       -1, 0);
+	if (mapping == MAP_FAILED)
+		return NULL;
+
+	if (guard && mprotect(mapping, guard_size, PROT_NONE)) {
+		munmap(mapping, guard_size + size);
+		return NULL;
+	}
+
+	return mapping + guard_size;
+}
+
+void uthread_ctx_destroy_stack(void *top_of_stack, size_t size, int guard)
+{
+	size_t guard_size;
+
+	if (!top_of_stack)
+		return;
+
+	size = uthread_ctx_stack_size(size);
+	guard_size = guard ? page_size : 0;
+
+	if (stack_cacheable(size, guard) &&
+	    stack_cache_count < UTHREAD_STACK_CACHE) {
+		*(void **)top_of_stack = stack_cache;
+		stack_cache = top_of_stack;
+		stack_cache_count++;
+		return;
+	}
+
+	munmap((uint8_t *)top_of_stack - guard_size, guard_size + size);
+}
+
+void uthread_ctx_release_stacks(void)
+{
+	/* Cached stacks are all of the default size, as mapped */
+	size_t size = uthread_ctx_stack_size(0);
+
+	while (stack_cache) {
+		void *stack = stack_cache;
+
+		stack_cache = *(void **)stack;
+		munmap((uint8_t *)stack - page_size, page_size + size);
+	}
+
+	stack_cache_count = 0;
 }
 
 /*
@@ -47,8 +214,34 @@ static void uthread_ctx_bootstrap(uthread_func_t func, void *arg)
 }
 
 int uthread_ctx_init(uthread_ctx_t *uctx, void *top_of_stack,
-		     uthread_func_t func, void *arg)
+		     size_t stack_size, uthread_func_t func, void *arg)
 {
+	stack_size = uthread_ctx_stack_size(stack_size);
+
+#ifdef UTHREAD_CTX_ASM
+	/*
+	 * Lay out the end of the stack as uthread_ctx_swap() leaves it, so that
+	 * switching to @uctx for the first time "returns" to the trampoline
+	 * with a 16-byte aligned stack:
+	 * MXCSR and x87 control word, %r15, %r14, %r13, %r12, %rbx, %rbp,
+	 * return address
+	 */
+	uintptr_t end = ((uintptr_t)top_of_stack + stack_size) & ~(uintptr_t)15;
+	uint64_t *frame = (uint64_t *)end - 8;
+
+	frame[0] = UTHREAD_MXCSR | (uint64_t)UTHREAD_FPU_CW << 32;
+	frame[1] = 0;					/* %r15 */
+	frame[2] = (uintptr_t)uthread_ctx_bootstrap;	/* %r14 */
+	frame[3] = (uintptr_t)arg;			/* %r13 */
+	frame[4] = (uintptr_t)func;			/* %r12 */
+	frame[5] = 0;					/* %rbx */
+	frame[6] = 0;					/* %rbp */
+	frame[7] = (uintptr_t)uthread_ctx_trampoline;
+
+	uctx->sp = frame;
+
+	return 0;
+#else
 	/*
 	 * Initialize the passed context @uctx to the currently active context
 	 */
@@ -59,7 +252,7 @@ int uthread_ctx_init(uthread_ctx_t *uctx, void *top_of_stack,
 	 * Change context @uctx's stack to the specified stack
 	 */
 	uctx->uc_stack.ss_sp = top_of_stack;
-	uctx->uc_stack.ss_size = UTHREAD_STACK_SIZE;
+	uctx->uc_stack.ss_size = stack_size;
 
 	/*
 	 * Finish setting up context @uctx:
@@ -72,5 +265,6 @@ int uthread_ctx_init(uthread_ctx_t *uctx, void *top_of_stack,
 		    2, func, arg);
 
 	return 0;
+#endif
 }
 
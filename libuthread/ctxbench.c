@@ -0,0 +1,163 @@
+/*
+ * ctxbench - Benchmark thread context switches
+ *
+ * Measure the cost of one switch between two threads: with
+ * uthread_ctx_switch() alone, with swapcontext() for comparison, and through
+ * uthread_yield(), which also blocks and unblocks the preemption signal and
+ * goes through the ready queue. Then measure the cost of a short-lived thread,
+ * created, run and exited while another thread creates the next ones.
+ *
+ * Usage: ctxbench [switches]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <ucontext.h>
+
+#include "private.h"
+#include "uthread.h"
+
+/* Stack of the swapcontext() thread */
+#define BENCH_STACK_SIZE 32768
+
+static long num_switches = 1000000;
+
+static uthread_ctx_t main_ctx, peer_ctx;
+static ucontext_t main_uc, peer_uc;
+
+static uint64_t yield_ns, churn_ns;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void report(const char *name, uint64_t elapsed)
+{
+	printf("%-12s %8.1f ns/switch\n", name, (double)elapsed / num_switches);
+}
+
+/* Switch straight back, forever */
+static void peer_ctx_loop(void *arg)
+{
+	(void)arg;
+
+	for (;;)
+		uthread_ctx_switch(&peer_ctx, &main_ctx);
+}
+
+static void peer_uc_loop(void)
+{
+	for (;;)
+		swapcontext(&peer_uc, &main_uc);
+}
+
+static void bench_ctx_switch(void)
+{
+	void *stack = uthread_ctx_alloc_stack(0, 1);
+	uint64_t start;
+
+	if (!stack || uthread_ctx_init(&peer_ctx, stack, 0, peer_ctx_loop, NULL)) {
+		fprintf(stderr, "ctxbench: cannot create a context\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Each round trip is two switches */
+	start = now_ns();
+	for (long i = 0; i < num_switches / 2; i++)
+		uthread_ctx_switch(&main_ctx, &peer_ctx);
+	report("ctx_switch", now_ns() - start);
+
+	uthread_ctx_destroy_stack(stack, 0, 1);
+}
+
+static void bench_swapcontext(void)
+{
+	void *stack = malloc(BENCH_STACK_SIZE);
+	uint64_t start;
+
+	if (!stack || getcontext(&peer_uc)) {
+		fprintf(stderr, "ctxbench: cannot create a context\n");
+		exit(EXIT_FAILURE);
+	}
+
+	peer_uc.uc_stack.ss_sp = stack;
+	peer_uc.uc_stack.ss_size = BENCH_STACK_SIZE;
+	makecontext(&peer_uc, peer_uc_loop, 0);
+
+	start = now_ns();
+	for (long i = 0; i < num_switches / 2; i++)
+		swapcontext(&main_uc, &peer_uc);
+	report("swapcontext", now_ns() - start);
+
+	free(stack);
+}
+
+/* The idle thread runs in between two yields: two switches per yield */
+static void yield_thread(void *arg)
+{
+	uint64_t start = now_ns();
+
+	(void)arg;
+
+	for (long i = 0; i < num_switches / 2; i++)
+		uthread_yield();
+
+	yield_ns = now_ns() - start;
+}
+
+static void short_thread(void *arg)
+{
+	(*(long *)arg)++;
+}
+
+/* Threads created one at a time, each one exits before the next is created */
+static void churn_thread(void *arg)
+{
+	long done = 0;
+	uint64_t start = now_ns();
+
+	(void)arg;
+
+	for (long i = 0; i < num_switches / 4; i++) {
+		if (uthread_create(short_thread, &done)) {
+			fprintf(stderr, "ctxbench: cannot create a thread\n");
+			exit(EXIT_FAILURE);
+		}
+		uthread_yield();
+	}
+
+	churn_ns = now_ns() - start;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1)
+		num_switches = atol(argv[1]);
+	if (num_switches < 2) {
+		fprintf(stderr, "Usage: %s [switches]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	bench_ctx_switch();
+	bench_swapcontext();
+
+	if (uthread_start(yield_thread, NULL)) {
+		fprintf(stderr, "ctxbench: cannot start threads\n");
+		return EXIT_FAILURE;
+	}
+	report("yield", yield_ns);
+
+	if (uthread_start(churn_thread, NULL)) {
+		fprintf(stderr, "ctxbench: cannot start threads\n");
+		return EXIT_FAILURE;
+	}
+	printf("%-12s %8.1f ns/thread\n", "create", (double)churn_ns / (num_switches / 4));
+
+	return EXIT_SUCCESS;
+}
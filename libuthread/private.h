@@ -12,6 +12,7 @@
  */
 #include <ucontext.h>
 
+#include "queue.h"
 #include "uthread.h"
 
 /*
@@ -23,8 +24,20 @@
  * Such a context is initialized for the first time when creating a thread with
  * uthread_ctx_init(). Once initialized, it can be switched to with
  * uthread_ctx_switch().
- */
+ *
+ * On x86-64, contexts are switched by hand: only the callee-saved registers are
+ * kept, on the thread's own stack, and the context is the saved stack pointer.
+ * Elsewhere, or when built with UTHREAD_UCONTEXT defined, contexts are
+ * switched with swapcontext().
+ */
+#if defined(__x86_64__) && !defined(UTHREAD_UCONTEXT)
+#define UTHREAD_CTX_ASM
+typedef struct {
+	void *sp;
+} uthread_ctx_t;
+#else
 typedef ucontext_t uthread_ctx_t;
+#endif
 
 /*
  * uthread_ctx_switch - Switch between two execution contexts
@@ -34,32 +47,58 @@ typedef ucontext_t uthread_ctx_t;
  */
 void uthread_ctx_switch(uthread_ctx_t *prev, uthread_ctx_t *next);
 
+/*
+ * uthread_ctx_stack_size - Get the actual size of a stack segment
+ * @size: Requested size in bytes, 0 for the default size
+ *
+ * Return: @size raised to the minimum size and rounded up to whole pages
+ */
+size_t uthread_ctx_stack_size(size_t size);
+
 /*
  * uthread_ctx_alloc_stack - Allocate stack segment
+ * @size: Size of the stack in bytes, 0 for the default size
+ * @guard: Non-zero to map a guard page below the stack
+ *
+ * The memory of stacks is only committed when touched. With a guard page,
+ * overflowing the stack faults. The default-size stacks of exited threads are
+ * reused first.
  *
  * Return: Pointer to the top of a valid stack segment, or NULL in case of
  * failure
  */
-void *uthread_ctx_alloc_stack(void);
+void *uthread_ctx_alloc_stack(size_t size, int guard);
 
 /*
  * uthread_ctx_destroy_stack - Deallocate stack segment
  * @top_of_stack: Address of stack to deallocate
+ * @size: Size of the stack, as passed to uthread_ctx_alloc_stack()
+ * @guard: Guard page setting, as passed to uthread_ctx_alloc_stack()
+ *
+ * A bounded number of default-size stacks is kept for
+ * uthread_ctx_alloc_stack(), the others are unmapped.
+ */
+void uthread_ctx_destroy_stack(void *top_of_stack, size_t size, int guard);
+
+/*
+ * uthread_ctx_release_stacks - Unmap the stacks kept for reuse
  */
-void uthread_ctx_destroy_stack(void *top_of_stack);
+void uthread_ctx_release_stacks(void);
 
 /*
  * uthread_ctx_init - Initialize a thread's execution context
  * @uctx: Pointer to thread context to initialize
  * @top_of_stack: Pointer to the top of a valid stack segment, as allocated by
  *	uthread_ctx_alloc_stack()
+ * @stack_size: Size of the stack segment, as passed to
+ *	uthread_ctx_alloc_stack()
  * @func: Function to be executed by the thread
  * @arg: Argument to pass to the thread
  *
  * Return: 0 if @uctx was properly initialized, or -1 in case of failure
  */
 int uthread_ctx_init(uthread_ctx_t *uctx, void *top_of_stack,
-		     uthread_func_t func, void *arg);
+		     size_t stack_size, uthread_func_t func, void *arg);
 
 
 /**
@@ -121,4 +160,24 @@ void uthread_block(void);
  */
 void uthread_unblock(struct uthread_tcb *uthread);
 
+/*
+ * uthread_link - Get the queue link of a thread
+ * @uthread: TCB of thread
+ *
+ * A thread is in at most one queue at a time: ready to run, exited, or blocked
+ * on a semaphore. All of them link the thread through this same link, so that
+ * no queue operation allocates memory.
+ *
+ * Return: Pointer to the queue link embedded in @uthread
+ */
+struct queue_link *uthread_link(struct uthread_tcb *uthread);
+
+/*
+ * uthread_from_link - Get the thread of a queue link
+ * @link: Queue link, as returned by uthread_link()
+ *
+ * Return: Pointer to the TCB containing @link
+ */
+struct uthread_tcb *uthread_from_link(struct queue_link *link);
+
 #endif /* _UTHREAD_PRIVATE_H */
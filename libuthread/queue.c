@@ -43,9 +43,12 @@ int queue_destroy(queue_t queue)
 
 int queue_enqueue(queue_t queue, void *data)
 {
+	if(queue == NULL || data == NULL)
+		return -1;
+
 	struct queue_node* new_node = malloc(sizeof(struct queue_node));
 
-	if(queue == NULL || data == NULL || new_node == NULL)
+	if(new_node == NULL)
 		return -1;
 
 	/* assign values into the new_node */
@@ -76,10 +79,13 @@ int queue_dequeue(queue_t queue, void **data)
 	if(queue == NULL || data == NULL || queue->first == NULL)
 		return -1;
 
+	struct queue_node* first_node = queue->first;
+
 	/* store the adreess of data into the *data */
-	*data = queue->first->data;
+	*data = first_node->data;
 
-	queue->first = queue->first->next;
+	queue->first = first_node->next;
+	free(first_node);
 
 	/* if the queue is empty */
 	if(queue->first == NULL)
@@ -150,3 +156,47 @@ int queue_length(queue_t queue)
 
 	return queue->length;
 }
+
+void queue_list_init(struct queue_list *list)
+{
+	/* an empty list is its head linked to itself */
+	list->head.prev = &list->head;
+	list->head.next = &list->head;
+	list->length = 0;
+}
+
+void queue_list_push(struct queue_list *list, struct queue_link *link)
+{
+	/* link the item between the newest item and the head */
+	link->prev = list->head.prev;
+	link->next = &list->head;
+	list->head.prev->next = link;
+	list->head.prev = link;
+	list->length += 1;
+}
+
+struct queue_link *queue_list_pop(struct queue_list *list)
+{
+	struct queue_link* link = list->head.next;
+
+	if(link == &list->head)
+		return NULL;
+
+	queue_list_remove(list, link);
+
+	return link;
+}
+
+void queue_list_remove(struct queue_list *list, struct queue_link *link)
+{
+	link->prev->next = link->next;
+	link->next->prev = link->prev;
+	link->prev = NULL;
+	link->next = NULL;
+	list->length -= 1;
+}
+
+int queue_list_length(struct queue_list *list)
+{
+	return list->length;
+}
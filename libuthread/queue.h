@@ -1,6 +1,8 @@
 #ifndef _QUEUE_H
 #define _QUEUE_H
 
+#include <stddef.h>
+
 /*
  * queue_t - Queue type
  *
@@ -106,4 +108,75 @@ int queue_iterate(queue_t queue, queue_func_t func);
  */
 int queue_length(queue_t queue);
 
+/*
+ * queue_link - Intrusive queue link
+ *
+ * Unlike queue_t, which allocates a node for every enqueued item, an intrusive
+ * queue links items through a struct queue_link embedded in the items
+ * themselves: enqueueing never allocates and never fails, and an item can be
+ * removed from anywhere in the queue in O(1). An item can only be in one queue
+ * per embedded link at a time.
+ */
+struct queue_link {
+	struct queue_link *prev;
+	struct queue_link *next;
+};
+
+/*
+ * queue_list - Intrusive queue
+ *
+ * A circular doubly-linked list of items around @head. It must be initialized
+ * with queue_list_init() before use.
+ */
+struct queue_list {
+	struct queue_link head;
+	int length;
+};
+
+/*
+ * queue_entry - Get the item containing a queue link
+ * @link: Address of the link
+ * @type: Type of the item
+ * @member: Name of the link within @type
+ */
+#define queue_entry(link, type, member) \
+	((type *)((char *)(link) - offsetof(type, member)))
+
+/*
+ * queue_list_init - Initialize an empty intrusive queue
+ * @list: Intrusive queue to initialize
+ */
+void queue_list_init(struct queue_list *list);
+
+/*
+ * queue_list_push - Enqueue item in intrusive queue
+ * @list: Intrusive queue in which to enqueue item
+ * @link: Link of the item, not currently in any queue
+ */
+void queue_list_push(struct queue_list *list, struct queue_link *link);
+
+/*
+ * queue_list_pop - Dequeue item from intrusive queue
+ * @list: Intrusive queue in which to dequeue item
+ *
+ * Return: Link of the oldest item of @list, removed from it. NULL if @list is
+ * empty.
+ */
+struct queue_link *queue_list_pop(struct queue_list *list);
+
+/*
+ * queue_list_remove - Remove item from intrusive queue
+ * @list: Intrusive queue containing the item
+ * @link: Link of the item to remove
+ */
+void queue_list_remove(struct queue_list *list, struct queue_link *link);
+
+/*
+ * queue_list_length - Intrusive queue length
+ * @list: Intrusive queue to get the length of
+ *
+ * Return: Number of items in @list
+ */
+int queue_list_length(struct queue_list *list);
+
 #endif /* _QUEUE_H */
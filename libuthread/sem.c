@@ -7,7 +7,7 @@
 
 struct semaphore {
 	int key;
-	queue_t block_queue;
+	struct queue_list block_queue;
 };
 
 sem_t sem_create(size_t count)
@@ -18,17 +18,17 @@ sem_t sem_create(size_t count)
 		return NULL;
 
 	new_sem->key = count;
-	new_sem->block_queue = queue_create();
+	queue_list_init(&new_sem->block_queue);
 
 	return new_sem;
 }
 
 int sem_destroy(sem_t sem)
 {
-	if(sem == NULL || queue_length(sem->block_queue) == 0)
+	/* threads still blocked on the semaphore would never be woken up */
+	if(sem == NULL || queue_list_length(&sem->block_queue) != 0)
 		return -1;
-	
-	queue_destroy(sem->block_queue);
+
 	free(sem);
 
 	return 0;
@@ -45,7 +45,7 @@ int sem_down(sem_t sem)
 	while(sem->key == 0) {
 		struct uthread_tcb* tmp = uthread_current();
 
-		queue_enqueue(sem->block_queue, tmp);
+		queue_list_push(&sem->block_queue, uthread_link(tmp));
 		
 		uthread_block();
 	}
@@ -67,12 +67,10 @@ int sem_up(sem_t sem)
 	preempt_disable();
 	
 	/* if there are blocked thread in the block_queue, release them back to the schedule queue in main */
-	if(queue_length(sem->block_queue) != 0) {
-		struct uthread_tcb* tmp;
-
-		queue_dequeue(sem->block_queue, (void**)&tmp);
+	if(queue_list_length(&sem->block_queue) != 0) {
+		struct queue_link* link = queue_list_pop(&sem->block_queue);
 
-		uthread_unblock(tmp);
+		uthread_unblock(uthread_from_link(link));
 	}
 
 	sem->key += 1;
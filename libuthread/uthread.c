@@ -15,14 +15,17 @@
 #define STATUS_BLOCK 3
 #define STATUS_EXIT 4
 
-static queue_t ready_queue;						/* the main ready queue */
-static queue_t recycle_bin;						/* collect the exited threads*/
+static struct queue_list ready_queue;			/* the main ready queue */
+static struct queue_list recycle_bin;			/* collect the exited threads*/
 static struct uthread_tcb* running_thread;		/* the current running thread, usually the functions */
 
 struct uthread_tcb {
 	uthread_ctx_t *exe_context;
 	void* stack_ptr;
+	size_t stack_size;
+	int stack_guard;
 	int state;
+	struct queue_link link;		/* in the ready queue, the recycle bin or a semaphore */
 };
 
 struct uthread_tcb *uthread_current(void)
@@ -30,23 +33,36 @@ struct uthread_tcb *uthread_current(void)
 	return running_thread;
 }
 
-void garbage_cleaner() {
-	struct uthread_tcb* exited_thread;
+struct queue_link *uthread_link(struct uthread_tcb *uthread)
+{
+	return &uthread->link;
+}
 
-	/* clean up the recycle bin first */
-	queue_dequeue(recycle_bin, (void**)&exited_thread);
+struct uthread_tcb *uthread_from_link(struct queue_link *link)
+{
+	return queue_entry(link, struct uthread_tcb, link);
+}
+
+/* release the exited threads, none of them runs on its stack anymore */
+void recycle_exited() {
+	struct queue_link* link;
 
-	while(queue_length(recycle_bin) != 0) {
-		uthread_ctx_destroy_stack(exited_thread->stack_ptr);
+	/* their stacks go back to the pool, ready for the next threads */
+	while((link = queue_list_pop(&recycle_bin)) != NULL) {
+		struct uthread_tcb* exited_thread = uthread_from_link(link);
+
+		uthread_ctx_destroy_stack(exited_thread->stack_ptr, exited_thread->stack_size, exited_thread->stack_guard);
 		free(exited_thread->exe_context);
 		free(exited_thread);
-
-		queue_dequeue(recycle_bin, (void**)&exited_thread);
 	}
+}
+
+void garbage_cleaner() {
+	/* clean up the recycle bin first */
+	recycle_exited();
 
-	/* destory all the queues */
-	queue_destroy(ready_queue);
-	queue_destroy(recycle_bin);
+	/* unmap the stacks kept for new threads */
+	uthread_ctx_release_stacks();
 }
 
 void uthread_yield(void)
@@ -64,16 +80,16 @@ void uthread_yield(void)
 	{
 		/* if the yield comes from a running thread */
 		prev_tcb->state = STATUS_READY;
-		queue_enqueue(ready_queue, prev_tcb);
+		queue_list_push(&ready_queue, &prev_tcb->link);
 	} else if(prev_tcb->state == STATUS_EXIT) {
 		/* if the yield comes from a exit thread */
 		/* no need to push it back to the ready queue */
 		/* throw it to the recycle bin */
-		queue_enqueue(recycle_bin, prev_tcb);
+		queue_list_push(&recycle_bin, &prev_tcb->link);
 	}
 
 	/* throw the next thread in line into the next_tcb */
-	queue_dequeue(ready_queue, (void**) &next_tcb);
+	next_tcb = uthread_from_link(queue_list_pop(&ready_queue));
 
 	/* next thread will be put to run */
 	next_tcb->state = STATUS_RUN;
@@ -83,7 +99,10 @@ void uthread_yield(void)
 
 	/* go to the next thread */
 	uthread_ctx_switch(prev_tcb->exe_context, next_tcb->exe_context);
-	
+
+	/* back on another stack than the one of a thread that just exited */
+	recycle_exited();
+
 	preempt_enable();
 }
 
@@ -95,22 +114,45 @@ void uthread_exit(void)
 }
 
 int uthread_create(uthread_func_t func, void *arg)
+{
+	return uthread_create_attr(func, arg, NULL);
+}
+
+int uthread_create_attr(uthread_func_t func, void *arg, const struct uthread_attr *attr)
 {
 	preempt_disable();
+
+	/* the stacks of the threads that exited since the last switch can be reused */
+	recycle_exited();
+
 	/* malloc a new_thread */
 	struct uthread_tcb* new_thread = malloc(sizeof(struct uthread_tcb));
-	new_thread->stack_ptr   = uthread_ctx_alloc_stack();
+
+	/* error checking */
+	if(new_thread == NULL) {
+		preempt_enable();
+		return -1;
+	}
+
+	new_thread->stack_size  = uthread_ctx_stack_size(attr != NULL ? attr->stack_size : 0);
+	new_thread->stack_guard = attr == NULL || !attr->no_guard;
+	new_thread->stack_ptr   = uthread_ctx_alloc_stack(new_thread->stack_size, new_thread->stack_guard);
 	new_thread->state   = STATUS_READY;
 	new_thread->exe_context = malloc(sizeof(uthread_ctx_t));
 
 	/* error checking */
-	if(new_thread == NULL || new_thread->stack_ptr == NULL || new_thread->exe_context == NULL)
+	if(new_thread->stack_ptr == NULL || new_thread->exe_context == NULL) {
+		uthread_ctx_destroy_stack(new_thread->stack_ptr, new_thread->stack_size, new_thread->stack_guard);
+		free(new_thread->exe_context);
+		free(new_thread);
+		preempt_enable();
 		return -1;
+	}
 
 	/* initialize the new_thread  and throw it to the ready queue*/
-	uthread_ctx_init(new_thread->exe_context, new_thread->stack_ptr, func, arg);
+	uthread_ctx_init(new_thread->exe_context, new_thread->stack_ptr, new_thread->stack_size, func, arg);
 
-	queue_enqueue(ready_queue, new_thread);
+	queue_list_push(&ready_queue, &new_thread->link);
 
 	preempt_enable();
 
@@ -119,8 +161,8 @@ int uthread_create(uthread_func_t func, void *arg)
 
 int uthread_start(uthread_func_t func, void *arg)
 {
-	ready_queue = queue_create();
-	recycle_bin = queue_create();
+	queue_list_init(&ready_queue);
+	queue_list_init(&recycle_bin);
 
 	/* build an idle thread to come back from */
 	struct uthread_tcb* idle_thread = malloc(sizeof(struct uthread_tcb));
@@ -139,7 +181,7 @@ int uthread_start(uthread_func_t func, void *arg)
 	/* initialize the timer */
 	preempt_start();
 
-	while(queue_length(ready_queue) != 0)
+	while(queue_list_length(&ready_queue) != 0)
 		uthread_yield();
 
 	/* terminate the timer */
@@ -160,5 +202,5 @@ void uthread_block(void)
 void uthread_unblock(struct uthread_tcb *uthread)
 {
 	uthread->state = STATUS_READY;
-	queue_enqueue(ready_queue, uthread);
+	queue_list_push(&ready_queue, &uthread->link);
 }
@@ -1,12 +1,24 @@
 #ifndef _UTHREAD_H
 #define _UTHREAD_H
 
+#include <stddef.h> /* for size_t definition */
+
 /*
  * uthread_func_t - Thread function type
  * @arg: Argument to be passed to the thread
  */
 typedef void (*uthread_func_t)(void *arg);
 
+/*
+ * uthread_attr - Attributes of a new thread, see uthread_create_attr()
+ * @stack_size: Size of the thread's stack in bytes, 0 for the default size
+ * @no_guard: Non-zero to leave out the guard page below the stack
+ */
+struct uthread_attr {
+	size_t stack_size;
+	int no_guard;
+};
+
 /*
  * uthread_start - Start the multithreading library
  * @func: Function of the first thread to start
@@ -34,6 +46,28 @@ int uthread_start(uthread_func_t func, void *arg);
  */
 int uthread_create(uthread_func_t func, void *arg);
 
+/*
+ * uthread_create_attr - Create a new thread with the given attributes
+ * @func: Function to be executed by the thread
+ * @arg: Argument to be passed to the thread
+ * @attr: Attributes of the thread, NULL for the default ones
+ *
+ * Same as uthread_create(), with a stack of @attr->stack_size bytes, rounded up
+ * to whole pages. The stack is only reserved: its memory is committed as the
+ * thread touches it, so a deep-recursion thread can be given megabytes while
+ * a mostly idle one costs a page or two.
+ *
+ * Each stack with a guard page takes two memory mappings, which the system
+ * limits in number. Stacks without a guard page can be merged into fewer
+ * mappings, which allows for many more threads at once, but overflowing them
+ * is not caught anymore.
+ *
+ * Return: 0 in case of success, -1 in case of failure (e.g., memory allocation,
+ * context creation).
+ */
+int uthread_create_attr(uthread_func_t func, void *arg,
+			const struct uthread_attr *attr);
+
 /*
  * uthread_yield - Yield execution
  *